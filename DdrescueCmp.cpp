@@ -17,6 +17,80 @@
 **
 ** And this program double-checks the ddrescue results by scanning both ddrfile.iso and ddrfile2.iso
 ** and checks that all rescued regions in the two files match byte-for-byte.
+** Both .iso files are memory mapped where possible and compared with the widest vector
+** instructions the CPU has. The address of the first differing byte is reported.
+**
+**  ddrescuecmp ddrfile -c ddrfile2 -j 8
+**
+** The -j switch splits the overlapping regions into work units and compares them on N threads.
+** The lowest mismatching address is still the one reported, whichever thread finds it.
+**
+**  ddrescuecmp ddrfile -c ddrfile2 -diff mismatch.log
+**
+** Instead of stopping at the first difference, -diff compares all the overlapping regions and
+** writes every 2048 byte block that differs to mismatch.log, a ddrescue mapfile in which those
+** blocks are bad-sector ('-') and everything else is finished. "ddrescue -r1" run with a copy of
+** it rereads exactly those blocks.
+**
+**  ddrescuecmp ddrfile -c ddrfile2 -c ddrfile3 -merge best
+**
+** -c may be repeated to compare any number of rescues of the same disc in one pass. Each region
+** is compared across all the images whose mapfiles mark it rescued. -merge writes best.iso and
+** best.log from all of them: a region only one image rescued is copied from it, and where
+** several did, each 2048 byte block is taken from the majority. Blocks with no majority are
+** marked bad-sector in best.log. Each image is read once.
+** Ranges that only one image rescued are copied file to file by the kernel (as a reflink on
+** filesystems that can share blocks), and ranges no image rescued are left as holes in best.iso.
+**
+**  ddrescuecmp ddrfile -gz archive
+**
+** -gz writes archive.iso.gz, ddrfile.iso compressed, and archive.log, a copy of ddrfile.log, so a
+** rescue can be kept without the room of the whole image. archive then goes wherever a rescue's
+** name does, as the first argument or with -c: with no archive.iso, archive.iso.gz is read.
+** The image is cut into 256KB frames, and each is deflated into a gzip member of its own, with
+** an index of them at the end. A read inflates only the frames it touches, several at once if
+** it spans more than one, and the last few frames read stay cached. Frames that are only '?' in
+** ddrfile.log (whatever --status says), or holes in ddrfile.iso, aren't stored and read as zeros.
+** gzip -t checks the file. Reading and writing these needs a build with zlib, which "make" does
+** where zlib is installed.
+**
+**  ddrescuecmp ddrfile -c ddrfile2 -idx
+**
+** -idx keeps ddrfile.idx and ddrfile2.idx next to the .iso files. Each holds a 64 bit hash of
+** every 2048 byte block along with the mapfile status the block had when it was hashed.
+** A run with -idx hashes only the blocks whose status changed since the last run, and then
+** reads only the blocks whose hashes don't match for the byte-by-byte compare.
+**
+**  ddrescuecmp ddrfile -edc bad.log -ecc
+**
+** For a raw image (2352 byte sectors, as read with ddrescue -b2352 from a drive that returns
+** them) there may be no second rescue to compare against. A drive's '+' only says it returned
+** something. -edc recomputes the EDC of every rescued Mode 1 and Mode 2 sector and writes the
+** sectors that fail to bad.log, a mapfile like the one -diff writes. -ecc checks the P and Q
+** parity too, which costs more than the EDC. Sectors without a sync pattern (audio) and those
+** with no EDC (Mode 0, Form 2 without one) are counted but can't be checked. So are Mode 2
+** sectors whose two subheader copies differ, as formless Mode 2 sectors have no subheader at
+** all. -edc implies --sector-size=2352.
+**
+**  ddrescuecmp ddrfile -c ddrfile2 -jpg jpg.txt --follow
+**
+** --follow is for running alongside ddrescue. After the first pass it waits for ddrescue to
+** rewrite a mapfile (watched with inotify on linux, polled elsewhere), then compares, carves and
+** extracts only what was rescued since the pass before. It stops once every mapfile says
+** ddrescue has finished. --follow can't be combined with -merge or -gz.
+**
+**  ddrescuecmp -batch discs.txt -j 4 --per-device=1
+**
+** runs a stack of discs in one process. Each line of discs.txt is a command line like the
+** ones above, such as "disc7 -c disc7b -x disc7files". Four jobs run at a time, but only one
+** of them reads .iso files from any one device, so a drive of the array streams one image
+** rather than seeking between several. The buffers of a finished job go to the next one.
+** Each job's output is printed whole when it finishes, followed at the end by a line per job
+** saying whether it passed. Options after the job file, such as --io=stream, apply to every job.
+**
+** By default only the regions ddrescue marked finished ('+') in its mapfile count as rescued.
+** The --status=CHARS switch selects other mapfile status characters instead (any of ? * / - +),
+** for example --status=-/ to look at the bad and non-scraped regions.
 **
 ** For file recovery, add the pair "-x Dir"
 **
@@ -32,576 +106,5598 @@
 **      1 checks the ddrfile.log file for whether the blocks required are rescued. If so, then
 **      2 it creates a directory named dirName
 **      3 it writes a file using the name in the triplet into that directory, from the corresponding bytes in the iso
+**  The files are written in the order they sit in the iso, not by name, so the iso is read in one sweep.
+**  The kernel copies the bytes (copy_file_range or sendfile), or shares the blocks on a filesystem
+**  that can reflink. With -j, N files are written at a time.
 **
 **  The triplet is parsed using heuristics that come from the use of the isodump utility (linux).
 **      A '[' character is expected to preceed the text for the triplet
 **      The string ";1" is expected to appear after the triplet
 **      NULL bytes in the text file are simply erased (this tends to convert charcters to ASCII)
 **      The triplet is white-space separated
-**          hex     CDROM block number of file (uints: 2048 byte blocks)
+**          hex     CDROM block number of file (uints: 2048 byte blocks, or --sector-size)
 **          len     decimal number of bytes of the file
 **          fname   name of the file
+**  Every triplet is kept. A name that is listed again is extracted as name~2.ext, name~3.ext...
+**  and the first of the name in the iso keeps it.
+**
+**  With -fs, there is no DIR.txt. The triplets come from the iso's own directories, read from
+**  the rescued blocks of ddrfile.iso: the Rock Ridge names if the disc has them, else the Joliet
+**  ones, else plain ISO9660. Only the volume descriptors and directories are read. Each file gets
+**  its full path, and the subdirectories are created under dirName. A directory that wasn't rescued
+**  is reported, and the path table finds whichever directories under it were.
+**
+**  -domain MAP goes with -x. It writes the blocks of the -x files (and with -fs, the directories)
+**  that aren't rescued yet to MAP, as a ddrescue domain mapfile: those blocks '+', the rest '?'.
+**  "ddrescue -m MAP" then spends its time only on the files wanted. How much of each file was
+**  rescued is printed, the files nearest to complete first.
+**
+**  -partial also goes with -x. A file that isn't wholly rescued is written anyway, on the last
+**  pass: only its rescued parts are copied, and the rest is left as holes (punched with fallocate
+**  on linux), never written as zeros. Next to each such file, FILE.log is a ddrescue style
+**  mapfile of it, its gaps marked '-'.
 **
 **  Maybe the CDROM is so garbled, isodump doesn't work and you can't generate triplets with it...
 **  The -jpg switch creates a file that has the triplets in it. It scans the iso file assuming the
 **  files are contiguous on the CDROM and creates a triplet for every jpg header it finds and that 
 **  is wholy contained in good blocks in the ddrescue.  You then have to invoke ddrescuecmp
 **  a second time with the -x switch naming the file created with -jpg
+**  The scan finds markers with memchr and jumps over marker segments by their length fields.
+**  With -j, separate rescued extents are scanned on N threads; the file is still written in
+**  address order.
+**
+**  -carve TXT does the same for more than jpegs. It looks up the first byte of each block in a
+**  table of file signatures (JFIF and EXIF jpeg, png, pdf, zip and so Office files, mp3 with an
+**  ID3 tag, avi and wav). Each kind has its own way to find where the file ends: walking jpeg
+**  segments or png chunks, a footer, the zip end record, mp3 frames, or a RIFF size field.
+**  All of them are looked for in one pass, and each file found gets a triplet named FileN.ext.
+**
+**  All of -c, -x and -jpg read the iso through a reader that runs ahead of the work,
+**  so reading the next chunk overlaps processing of the current one. Each prints its
+**  throughput when it finishes.
+**
+**  The .iso files are memory mapped, so they go through the page cache like any other file.
+**  A check of a huge image then pushes everything else on the box out of memory. --io=stream
+**  reads them with pread instead, and drops what was read from the cache once done with it.
+**  --io=direct does the same, with O_DIRECT reads into page aligned buffers wherever the
+**  reads are whole sectors. Ranges ddrescue rescued that are holes in an .iso (as ddrescue
+**  --sparse leaves them) are reported. Where they are holes in every image, -c doesn't read them.
+**
+**  The "blocks" of -diff, -merge, -jpg, -carve and DIR.txt are 2048 byte CDROM blocks unless
+**  --sector-size says otherwise: 2352 for a raw CD image, 512 or 4096 for a disk. The .idx
+**  hashes and the -fs directories stay in 2048 byte blocks, which is what those formats use.
+**
+**  While the mapfiles are read, the images compared, and files extracted or scanned, a line on
+**  stderr says how far that phase has got, how fast, and how long the rest should take. On a
+**  terminal it is redrawn each second, and otherwise written every 30 seconds. --stats=json
+**  writes a summary to stderr at the end: for each phase (readLog, coverage, index, compare,
+**  merge, gz, edc, fs, extract, jpg, carve), its wall and CPU seconds, the bytes it got through and
+**  its MB/s, the read syscalls and bytes, the seconds spent in those reads and waiting for the
+**  read ahead, and the major page faults, which is where the reads of a mapped image go.
+**
+**  Building needs a C++11 compiler. "make" builds with g++, and with zlib where its header is
+**  installed ("make ZLIB=0" leaves it out). On Windows, DdrescueCmp.vcxproj builds it with Visual
+**  Studio 2015 or later, as does "cl /EHsc /O2 DdrescueCmp.cpp", without -gz.
+**
+**  "make bench" times the mapfile parse, the compare, -x and -jpg on a synthetic rescue and writes
+**  the results to bench.json. bench/GenRescue.cpp writes the rescue, bench/BenchCmp.cpp times it.
 */
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cstdint>
+#include <cctype>
+#include <cmath>
+#include <cerrno>
+#include <ctime>
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
 #include <string>
 #include <map>
+#include <set>
+#include <list>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <limits>
+#include <exception>
+
+#if !defined(_WIN32)
+#define DDRESCUECMP_POSIX 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#else
+#include <direct.h>
+#include <malloc.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__linux__)
+#define DDRESCUECMP_LINUX 1
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#include <linux/falloc.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DDRESCUECMP_X86_DISPATCH 1
+#include <immintrin.h>
+#elif defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define DDRESCUECMP_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define DDRESCUECMP_NEON 1
+#include <arm_neon.h>
+#endif
+
+// the Makefile builds with zlib where it finds it, for -gz images. Without it they can be neither read nor written.
+#if defined(DDRESCUECMP_ZLIB)
+#include <zlib.h>
+#endif
 
 static const int CDROM_BLOCK_SIZE = 2048;
+static const int RAW_SECTOR_SIZE = 2352;    // a CD sector with its sync, header and EDC/ECC
 
 typedef unsigned long long AdrType_t;
-typedef std::map<AdrType_t, AdrType_t> AdrMap_t;
 
 // these are the triplets that describe files in the ISO
 struct FileDesc { 
     AdrType_t pos; 
     AdrType_t len; 
+    std::string name;   // what -x writes it as in DIR: the DIR.txt name, or the -fs path
     FileDesc(AdrType_t p, AdrType_t l) : pos(p), len(l) {}
+    FileDesc(AdrType_t p, AdrType_t l, const std::string &n) : pos(p), len(l), name(n) {}
     FileDesc() : pos(0), len(0){}
 };
-typedef std::map<std::string, FileDesc> FileDescMap_t;
+/* The -x files, as one flat table in address order (see sortFiles). Every triplet is kept,
+** including ones that repeat a name. */
+typedef std::vector<FileDesc> FileList_t;
 
-static void readLog(std::ifstream &instr, const std::string &fname, AdrMap_t &res);
+// a range of bytes in an image
+struct Extent {
+    AdrType_t pos;
+    AdrType_t len;
+    Extent(AdrType_t p, AdrType_t l) : pos(p), len(l) {}
+    Extent() : pos(0), len(0) {}
+};
+typedef std::vector<Extent> ExtentList_t;
 
-int main(int argc, char * argv[])
+/* A set of byte ranges, kept sorted by address in one contiguous vector.
+** A mapfile with hundreds of thousands of extents is then one allocation,
+** lookups are binary searches, and the set operations are linear merges. */
+class ExtentSet
 {
-    std::string f1IsoName;
-    std::string f2IsoName;
-    std::string dirName;
-    std::string jpgTextName;
+public:
+    typedef ExtentList_t::const_iterator const_iterator;
+    const_iterator begin() const { return m_extents.begin(); }
+    const_iterator end() const { return m_extents.end(); }
+    size_t size() const { return m_extents.size(); }
+    bool empty() const { return m_extents.empty(); }
+    const Extent &operator[](size_t i) const { return m_extents[i]; }
+    const ExtentList_t &extents() const { return m_extents; }
+    void reserve(size_t n) { m_extents.reserve(n); }
+    void clear() { m_extents.clear(); }
+
+    // add an extent at the end. pos must not be before the end of the last one.
+    void append(AdrType_t pos, AdrType_t len)
     {
-        bool minusC = false;
-        bool minusX = false;
-        bool minusJpg = false;
-        for (int i = 1; i < argc; i++)
+        if (!m_extents.empty() && (pos < m_extents.back().pos + m_extents.back().len))
+            throw std::logic_error("ExtentSet::append out of order");
+        m_extents.push_back(Extent(pos, len));
+    }
+    // add an extent at the end, joined to the last one if they touch or overlap.
+    // pos must not be before the start of the last one.
+    void extend(AdrType_t pos, AdrType_t len)
+    {
+        if (!m_extents.empty() && (pos <= m_extents.back().pos + m_extents.back().len))
         {
-            std::string arg = argv[i];
-            if (minusC)
-            {
-                minusC = false;
-                f2IsoName = arg;
-            }
-            else if (minusX)
-            {
-                minusX = false;
-                dirName = arg;
-            }
-            else if (minusJpg)
-            {
-                minusJpg = false;
-                jpgTextName = arg;
-            }
-            else if (arg == "-c")
-                minusC = true;
-            else if (arg == "-x")
-                minusX = true;
-            else if (arg == "-jpg")
-                minusJpg = true;
-            else 
-            {
-                if (f1IsoName.empty())
-                    f1IsoName = arg;
-                else
-                {
-                    f1IsoName.clear();
-                    break;
-                }
-            }
+            Extent &last = m_extents.back();
+            if (pos < last.pos)
+                throw std::logic_error("ExtentSet::extend out of order");
+            last.len = std::max(last.pos + last.len, pos + len) - last.pos;
         }
-        if (minusC || minusX || minusJpg)
-            f1IsoName.clear();
+        else
+            m_extents.push_back(Extent(pos, len));
     }
+    // merge extents that touch, in place
+    void coalesce();
+    // the extent holding pos, or end()
+    const_iterator find(AdrType_t pos) const;
+    // true if [pos, pos+len) lies within a single extent
+    bool contains(AdrType_t pos, AdrType_t len) const;
+    // the parts of [pos, pos+len) in the set
+    ExtentSet within(AdrType_t pos, AdrType_t len) const;
+    AdrType_t totalBytes() const;
+
+    static ExtentSet intersect(const ExtentSet &a, const ExtentSet &b);
+    static ExtentSet unite(const ExtentSet &a, const ExtentSet &b);
+    static ExtentSet subtract(const ExtentSet &a, const ExtentSet &b);
+
+private:
+    ExtentList_t m_extents;
+};
+
+// a range of addresses and which of the images (a bit per image) rescued all of it
+struct Coverage {
+    AdrType_t pos;
+    AdrType_t len;
+    unsigned images;
+};
+typedef std::vector<Coverage> CoverageList_t;
+static const unsigned MAX_IMAGES = 32;
+
+// one line of a ddrescue mapfile
+struct MapEntry {
+    AdrType_t pos;
+    AdrType_t len;
+    char status;
+};
+typedef std::vector<MapEntry> MapEntryList_t;
 
-    if (f1IsoName.empty())
+/* How the images are read (--io).
+**  IO_CACHED   mapped, through the page cache, the way everything else reads files
+**  IO_STREAM   read with pread, and each range dropped from the page cache once read, so a
+**              verify of a huge image doesn't push everything else on the box out of memory
+**  IO_DIRECT   as IO_STREAM, but reads that are aligned bypass the page cache (O_DIRECT)
+**  IO_READ     read with pread through the page cache, and never mapped. For the mapfiles, which
+**              ddrescue rewrites in place: a map of one it cuts short faults (SIGBUS) when touched,
+**              where a read just comes up short. */
+enum IoPolicy_t {IO_CACHED, IO_STREAM, IO_DIRECT, IO_READ};
+// O_DIRECT wants the file offset and length in multiples of the device's sector size,
+// and the buffer aligned. Buffers are aligned to a page, which covers any sector size.
+static const AdrType_t DIRECT_IO_SECTOR = 512;
+static const size_t DIRECT_IO_ALIGN = 4096;
+
+/* The reads of a run's images, counted by the images themselves. Mapped images aren't read
+** with syscalls: their I/O is the page faults of whatever touches the map. */
+struct IoCounters
+{
+    IoCounters() : reads(0), readBytes(0), readNanos(0), waitNanos(0) {}
+    // calls syscalls that read bytes, the last of them returning when it did
+    void count(unsigned calls, AdrType_t bytes, std::chrono::steady_clock::time_point start)
     {
-        std::cerr << "usage: ddrescuecmp <f1> [-c F2] [-x DIR] [-jpg JPG]" << std::endl
-            << "  These must exist: <f1>.iso <f1>.log" << std::endl
-            << "  and for -c, the files F2.iso F2.log must exist." << std::endl
-            << "  and for -x, the file DIR.txt must exist." << std::endl
-            << "  DIR.txt is edited from linux utility isodump." << std::endl
-            << " -jpg scans <f1>.iso for jpeg file headers and creates the file JPG, which will then work -x" << std::endl;
-        return 1;
+        reads += calls;
+        readBytes += bytes;
+        readNanos += static_cast<AdrType_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
     }
+    std::atomic<AdrType_t> reads;       // pread, copy_file_range, sendfile and reflink calls
+    std::atomic<AdrType_t> readBytes;
+    std::atomic<AdrType_t> readNanos;   // spent in those calls, added up over every thread
+    std::atomic<AdrType_t> waitNanos;   // spent by the work waiting for the read ahead
+};
+
+/* A -gz image (<f>.iso.gz) is a gzip file of many members, so gzip -t can check it. The image
+** is cut into frames of GZ_FRAME_SIZE bytes, and each frame ddrescue has read any of is
+** deflated on its own into a member of its own, so it can be inflated without the frames before
+** it. Frames that are all '?' in the mapfile aren't stored and read as zeros, like holes. After the frames,
+** a member holds the index, a GzFrame for each frame stored, 3 little endian 64 bit numbers each.
+** Last comes an empty member of GZ_TRAILER_SIZE bytes, its extra field the 'D','C' subfield:
+** where the index member starts and its length, the size of the image, the frame size, and how
+** many frames are stored, again 64 bit little endian. */
+static const AdrType_t GZ_FRAME_SIZE = 256 * 1024;
+static const AdrType_t GZ_TRAILER_SIZE = 66;
+struct GzFrame {
+    AdrType_t pos;      // in the image, a multiple of the frame size
+    AdrType_t offset;   // of its member in the file
+    AdrType_t length;   // of its member
+};
+static const AdrType_t GZ_INDEX_ENTRY = 3 * 8;
 
-    std::string f1LogName(f1IsoName);
-    std::string f2LogName(f2IsoName);
+/* An .iso opened for random access.
+** Where the platform allows, the whole image is memory mapped so that rescued
+** regions can be compared in place without first copying them into a buffer.
+** Otherwise read() falls back to pread (or to an ifstream on non-POSIX builds).
+** A -gz image is never mapped. read() inflates the frames it needs (see ImageFile::Frames). */
+class ImageFile
+{
+public:
+    ImageFile();
+    ~ImageFile();
+    // opening again picks up whatever the file has grown to since
+    bool open(const std::string &name, IoPolicy_t policy = IO_CACHED);
+    void close();
+    const std::string &name() const { return m_name; }
+    AdrType_t size() const { return m_size; }
+    // pointer to len bytes at pos, or NULL if the image is not mapped or too short
+    const unsigned char *map(AdrType_t pos, AdrType_t len) const;
+    // copy len bytes at pos into buf. false on a short read.
+    bool read(AdrType_t pos, char *buf, AdrType_t len);
+    // the bytes at pos won't be wanted again. For IO_STREAM and IO_DIRECT, they leave the page cache.
+    void doneWith(AdrType_t pos, AdrType_t len);
+    // the ranges of the file that are holes, that it has no blocks for. Empty where that can't be told.
+    // For a -gz image, the frames that aren't stored.
+    ExtentSet holes() const;
+    // count the reads of the file into io from now on. NULL stops counting.
+    void countInto(IoCounters *io) { m_io = io; }
+    IoCounters *counters() const { return m_io; }
+    // a -gz image: size() and the addresses are those of the image, not of the file
+    bool compressed() const { return m_frames.get() != 0; }
+#if defined(DDRESCUECMP_POSIX)
+    int fd() const { return m_fd; }
+#endif
+private:
+    class Frames;
+    ImageFile(const ImageFile &);
+    ImageFile &operator = (const ImageFile &);
+    // true if the file ends in a -gz trailer. m_frames is then set up, unless the image can't be read.
+    bool findFrames();
+    // read and drop bytes of the file itself, which for a -gz image are compressed ones
+    bool readFile(AdrType_t pos, char *buf, AdrType_t len);
+    void dropFile(AdrType_t pos, AdrType_t len);
+    std::string m_name;
+    AdrType_t m_size;
+    const unsigned char *m_map;
+    IoPolicy_t m_policy;
+    IoCounters *m_io;
+    std::unique_ptr<Frames> m_frames;
+#if defined(DDRESCUECMP_POSIX)
+    int m_fd;
+    int m_directFd;     // the file opened again for IO_DIRECT, or -1
+#else
+    std::ifstream m_stream;
+    std::mutex m_streamLock;
+#endif
+};
+typedef std::vector<ImageFile> ImageList_t;
 
-    std::string dirFileName;
-    if (!dirName.empty())
-        dirFileName = dirName + ".txt";
+/* Memory for reads, aligned for O_DIRECT. BUFSIZE is a multiple of the alignment, so each
+** worker's BUFSIZE slice of a shared one is aligned as well. */
+class AlignedBuffer
+{
+public:
+    explicit AlignedBuffer(size_t size = 0);
+    ~AlignedBuffer();
+    // the contents are not kept
+    void resize(size_t size);
+    size_t size() const { return m_size; }
+    bool empty() const { return !m_size; }
+    char &operator[](size_t i) { return m_data[i]; }
+private:
+    AlignedBuffer(const AlignedBuffer &);
+    AlignedBuffer &operator = (const AlignedBuffer &);
+    char *m_data;
+    size_t m_size;
+};
 
-    f1IsoName += ".iso";
-    f1LogName += ".log";
+/* An .iso being written. Only rescued ranges are ever written, and setSize extends the
+** file without writing, so on filesystems that support it the unrescued ranges stay holes. */
+class ImageWriter
+{
+public:
+    ImageWriter();
+    ~ImageWriter();
+    bool open(const std::string &name);
+    const std::string &name() const { return m_name; }
+    bool write(AdrType_t pos, const void *data, AdrType_t len);
+    // copy len bytes at srcPos in src to destPos in this file, letting the kernel do it (a reflink,
+    // copy_file_range or sendfile) when it can. reflinked gets how many of the bytes share blocks with src.
+    bool copyFrom(ImageFile &src, AdrType_t srcPos, AdrType_t destPos, AdrType_t len, char *buf, AdrType_t bufSize,
+        AdrType_t &reflinked);
+    bool setSize(AdrType_t size);
+    // make [pos, pos+len) a hole without changing the size. false where the platform or filesystem can't.
+    bool punchHole(AdrType_t pos, AdrType_t len);
+private:
+    ImageWriter(const ImageWriter &);
+    ImageWriter &operator = (const ImageWriter &);
+    std::string m_name;
+#if defined(DDRESCUECMP_POSIX)
+    int m_fd;
+#else
+    std::ofstream m_stream;
+#endif
+};
 
-    if (!f2IsoName.empty())
+/* Runs numbered tasks 0..count-1 on a set of worker threads.
+** Each worker starts out owning a contiguous slice of the task numbers, so a worker
+** mostly walks its part of an image in address order. A worker that runs out of
+** its own tasks steals the upper half of whatever another worker has left. */
+class WorkPool
+{
+public:
+    explicit WorkPool(unsigned threads) : m_threads(threads ? threads : 1), m_limit(0) {}
+    unsigned threads() const { return m_threads; }
+    // stop handing out tasks. Tasks already running finish normally.
+    void cancel() { cancelFrom(0); }
+    bool cancelled() const { return m_limit == 0; }
+    // stop handing out tasks numbered i or more, as when an earlier task has made their results moot.
+    // Tasks below i still run, as do those already running.
+    void cancelFrom(size_t i)
     {
-        f2IsoName += ".iso";
-        f2LogName += ".log";
+        size_t limit = m_limit;
+        while ((i < limit) && !m_limit.compare_exchange_weak(limit, i))
+            ;
     }
 
-    std::ifstream f1Iso(f1IsoName.c_str(), std::ifstream::binary);
-    if (!f1Iso.is_open())
+    // call task(i, worker) for every i in [0, count). worker is in [0, threads()).
+    // The first exception thrown by a task cancels the rest and is rethrown here.
+    template <typename Task>
+    void run(size_t count, Task task)
     {
-        std::cerr << "Failed to read " << f1IsoName << std::endl;
-        return -1;
+        m_limit = count;
+        m_error = std::exception_ptr();
+        unsigned n = static_cast<unsigned>(std::min<size_t>(m_threads, count));
+        if (n == 0)
+            return;
+        std::vector<Slice> slices(n);
+        for (unsigned w = 0; w < n; w++)
+        {
+            slices[w].next = count * w / n;
+            slices[w].end = count * (w + 1) / n;
+        }
+        std::vector<std::thread> workers;
+        for (unsigned w = 1; w < n; w++)
+            workers.push_back(std::thread(&WorkPool::work<Task>, this, std::ref(slices), w, std::ref(task)));
+        work<Task>(slices, 0, task);
+        for (size_t w = 0; w < workers.size(); w++)
+            workers[w].join();
+        if (m_error)
+            std::rethrow_exception(m_error);
     }
-    std::ifstream f1Log(f1LogName.c_str());
-    if (!f1Log.is_open())
+
+private:
+    struct Slice
     {
-        std::cerr << "Failed to read " << f1LogName << std::endl;
-        return -1;
-    }
+        std::mutex lock;
+        size_t next;
+        size_t end;
+    };
 
-    std::ifstream f2Iso;
-    std::ifstream f2Log;
-    if (!f2IsoName.empty())
+    // take the next task below m_limit from our own slice, else steal. false when there is
+    // nothing left.
+    bool take(std::vector<Slice> &slices, unsigned self, size_t &i)
     {
-        f2Iso.open(f2IsoName.c_str(), std::ifstream::binary);
-        if (!f2Iso.is_open())
         {
-            std::cerr << "Failed to read " << f2IsoName << std::endl;
-            return -1;
+            std::lock_guard<std::mutex> g(slices[self].lock);
+            if (slices[self].next < std::min<size_t>(slices[self].end, m_limit))
+            {
+                i = slices[self].next++;
+                return true;
+            }
         }
-        f2Log.open(f2LogName.c_str());
-        if (!f2Log.is_open())
+        for (unsigned k = 1; k < slices.size(); k++)
         {
-            std::cerr << "Failed to read " << f2LogName << std::endl;
-            return -1;
+            Slice &victim = slices[(self + k) % slices.size()];
+            size_t first, last;
+            {
+                std::lock_guard<std::mutex> g(victim.lock);
+                last = std::min<size_t>(victim.end, m_limit);
+                if (victim.next >= last)
+                    continue;
+                first = last - (last - victim.next + 1) / 2;
+                victim.end = first;
+            }
+            std::lock_guard<std::mutex> g(slices[self].lock);
+            slices[self].next = first + 1;
+            slices[self].end = last;
+            i = first;
+            return true;
         }
+        return false;
     }
 
-    static const AdrType_t BUFSIZE= CDROM_BLOCK_SIZE * 1024;
-    char *buf1 = new char [BUFSIZE];
-    char *buf2 = new char [BUFSIZE];
-
-    int ret = 0;
-
-    try {
-        FileDescMap_t FileDescMap;
-
-        if (!dirFileName.empty())
+    template <typename Task>
+    void work(std::vector<Slice> &slices, unsigned self, Task &task)
+    {
+        size_t i;
+        while (take(slices, self, i))
         {
-            std::ifstream ifs(dirFileName.c_str());
-            if (!ifs.is_open())
-            {
-                std::ostringstream oss;
-                oss << "Failed to read " << dirFileName << std::endl;
-                throw std::runtime_error(oss.str());
+            try {
+                task(i, self);
             }
-            std::string lineBuf;
-            while (std::getline(ifs, lineBuf))
+            catch (...)
             {
-                // looking for a block number, length, file name triplet
-                std::string::size_type bktPos;
-                for ( bktPos = 0; bktPos < lineBuf.size(); )
-                {   // assume only ASCII--remove NULL bytes from the line of text
-                    if (!lineBuf[bktPos])
-                        lineBuf.erase(lineBuf.begin() + bktPos);
-                    else
-                        bktPos++;
-                }
-                bktPos = lineBuf.find(']');
-                // expect to find a ']' character preceding the good stuff
-                if (bktPos != lineBuf.npos)
-                {
-                    lineBuf = lineBuf.substr(bktPos + 1);
-                    // expect to find the string ";1" after the good stuff
-                    bktPos = lineBuf.find(";1");
-                    if (bktPos != lineBuf.npos)
-                    {
-                        lineBuf = lineBuf.substr(0, bktPos);
-                        AdrType_t addr(0);
-                        AdrType_t fileLen(0);
-                        char fName[256];
-                        // the triplet is
-                        //      hex     (CDROM block number--2048 byte blocks0
-                        //      dec     (File length in decimal bytes)
-                        //      fileName    (name of the file)
-                        sscanf(lineBuf.c_str(), " %x %d %*s %255s", &addr, &fileLen, fName);
-                        addr *= CDROM_BLOCK_SIZE;
-                        FileDescMap[fName] = FileDesc(addr, fileLen);
-                    }
-                }
+                std::lock_guard<std::mutex> g(m_errorLock);
+                if (!m_error)
+                    m_error = std::current_exception();
+                cancel();
             }
         }
+    }
 
-        AdrMap_t f1Map;
-        AdrMap_t f2Map;
+    unsigned m_threads;
+    std::atomic<size_t> m_limit;        // tasks from here on aren't handed out
+    std::mutex m_errorLock;
+    std::exception_ptr m_error;
+};
 
-        readLog(f1Log, f1IsoName, f1Map);
+/* Walks a list of extents of one image in order, reading ahead of the consumer.
+** Each extent is cut into chunks of at most chunkSize bytes. For an image that is not
+** memory mapped, a ring of buffers is kept filled by pread threads, so the I/O for the
+** next chunks overlaps whatever the consumer is doing with the current one.
+** For a mapped image, chunks point straight into the map and reading ahead is an madvise. */
+class ExtentReader
+{
+public:
+    struct Chunk {
+        size_t extent;  // index into the extent list this chunk came from
+        AdrType_t pos;
+        AdrType_t len;
+        const unsigned char *data;  // NULL if the bytes could not be read
+    };
+    ExtentReader(ImageFile &image, const ExtentList_t &extents, AdrType_t chunkSize,
+        unsigned depth = 4, unsigned ioThreads = 2);
+    ~ExtentReader();
+    // the next chunk in order. false when all extents are done.
+    // The chunk's data is only valid until the following call.
+    bool next(Chunk &chunk);
+private:
+    ExtentReader(const ExtentReader &);
+    ExtentReader &operator = (const ExtentReader &);
+    void readAhead();
+    struct Slot {
+        char *buf;      // chunkSize bytes of m_bufs
+        size_t filled;  // index of the chunk in buf, or NO_CHUNK
+        bool ok;
+    };
+    static const size_t NO_CHUNK = ~static_cast<size_t>(0);
+    ImageFile &m_image;
+    std::vector<Chunk> m_chunks;
+    std::vector<Slot> m_slots;
+    AlignedBuffer m_bufs;
+    std::vector<std::thread> m_threads;
+    std::mutex m_lock;
+    std::condition_variable m_slotFree;
+    std::condition_variable m_slotFilled;
+    size_t m_next;      // chunk to hand out on the next call to next()
+    size_t m_issued;    // next chunk for a reader thread to start on
+    bool m_started;
+    bool m_stop;
+};
 
-        // and second ddrescue output, for -c
-        if (f2Log.is_open())
-            readLog(f2Log, f2IsoName, f2Map);
+/* The <f>.idx sidecar of an image: a 64 bit hash of each 2048 byte block, and the
+** mapfile status the block had when it was hashed. A hash stays good for as long as
+** the mapfile gives its block the same status, so a repeat -c only has to read
+** blocks that are newly rescued, and blocks whose hashes disagree. */
+class HashIndex
+{
+public:
+    // start from the index file, if there is a usable one. false if there is not.
+    bool load(const std::string &name, AdrType_t imageSize);
+    void save(const std::string &name) const;
+    // hash the blocks whose status in entries is wanted and differs from what the index has.
+    // Forget the ones no longer wanted. Returns the number of blocks hashed.
+    AdrType_t refresh(ImageFile &iso, const MapEntryList_t &entries, const std::string &statusChars,
+        WorkPool &pool, AdrType_t bufSize);
+    bool valid(AdrType_t block) const { return (block < m_status.size()) && m_status[block]; }
+    unsigned long long hash(AdrType_t block) const { return m_hash[block]; }
+private:
+    std::vector<unsigned long long> m_hash;
+    std::vector<char> m_status;    // 0 where there is no hash
+};
 
-        for (AdrMap_t::const_iterator i1 = f1Map.begin();
-            i1 != f1Map.end();
-            i1 ++)
-        {
-            AdrType_t f1First = i1->first;
-            AdrType_t f1Last = f1First + i1->second;
-            AdrMap_t::const_iterator i2 = f2Map.lower_bound(i1->first); // first entry not before
-            if (i2 != f2Map.begin()) 
-                i2--;    // back up one.
+/* The parts of a run that --stats=json reports, and the progress line names */
+enum Phase_t {PHASE_READ_LOG, PHASE_COVERAGE, PHASE_INDEX, PHASE_COMPARE, PHASE_MERGE, PHASE_COMPRESS, PHASE_EDC,
+    PHASE_FILESYSTEM, PHASE_EXTRACT, PHASE_JPEG, PHASE_CARVE, PHASE_COUNT};
 
-            for (; i2 != f2Map.end(); i2++)
-            {
-                AdrType_t f2First = i2->first;
-                AdrType_t f2Last = f2First + i2->second;
+/* Where the time of a run goes. A Timer times a phase, in wall and CPU time, along with the major
+** page faults and what the images' IoCounters count while it runs, and adds that to the phase's
+** totals over every pass. The work loops report the bytes they get through with advance(), and
+** while a phase runs, a progress line with its rate and what's left is written to the progress
+** stream, if there is one: over itself once a second on a terminal, or a line every 30 seconds
+** to a file. CPU time and page faults are the whole process's, so they include other -batch jobs. */
+class RunStats
+{
+public:
+    // progress is NULL for no progress line
+    explicit RunStats(std::ostream *progress);
+    IoCounters &io() { return m_io; }
 
-                if (f2First >= f1Last)
-                    break;
+    class Timer
+    {
+    public:
+        // total is the bytes the phase expects to get through, 0 if it can't say yet
+        Timer(RunStats &stats, Phase_t phase, AdrType_t total = 0);
+        ~Timer();
+    private:
+        Timer(const Timer &);
+        Timer &operator = (const Timer &);
+        RunStats &m_stats;
+        Phase_t m_phase;
+        std::chrono::steady_clock::time_point m_start;
+        double m_cpu;
+        long m_faults;
+        AdrType_t m_reads;
+        AdrType_t m_readBytes;
+        AdrType_t m_readNanos;
+        AdrType_t m_waitNanos;
+    };
 
-                if ((f2First < f1Last) && (f2Last > f1First))
-                {
-                    AdrType_t begin = std::max(f1First, f2First);
-                    AdrType_t end = std::min(f1Last, f2Last);
-                    std::cout << "Overlap starting 0x" << std::hex << begin << 
-                        " of length 0x" << std::hex << (end - begin) << std::endl;
-                    while (end > begin)
-                    {
-                        f1Iso.seekg(begin);
-                        if (f1Iso.eof())
-                            throw std::runtime_error("oops cannot seek f1Iso");
-                        f2Iso.seekg(begin);
-                        if (f2Iso.eof())
-                            throw std::runtime_error("oops cannot seek f2Iso" );
-                        AdrType_t readLen = std::min(BUFSIZE, end - begin);
-                        f1Iso.read(buf1, readLen);
-                        std::streamsize c = f1Iso.gcount();
-                        if (c != readLen)
-                            throw std::runtime_error( "oops cannot read f1Iso" );
-                        f2Iso.read(buf2, readLen);
-                        c = f2Iso.gcount();
-                        if (c != readLen)
-                            throw std::runtime_error( "oops cannot read f2Iso");
-
-                        const long *v1 = reinterpret_cast<long *>(buf1);
-                        const long *v2 = reinterpret_cast<long *>(buf2);
-                        for (AdrType_t i = 0; i < readLen/sizeof(long); i++)
-                        {
-                            if (*v1++ != *v2++)
-                            {
-                                std::ostringstream oss;
-                                oss << "Oops. Files do not match at 0x" << std::hex << (begin + i * sizeof(long)) ;
-                                throw std::runtime_error(oss.str());
-                            }
-                        }
-                        begin += readLen;
-                    }
-                }
-            }
-        }
+    // the phase running now expects to get through total bytes
+    void expect(AdrType_t total) { m_total = total; }
+    // the phase running now got through bytes more. Called by any thread.
+    void advance(AdrType_t bytes);
+    void writeJson(std::ostream &out) const;
 
-        // reduce the map to its smallest representation
-        // ddrescue never seems to have this redudancy in its log file output
-        for (AdrMap_t::iterator itor = f1Map.begin();
-            itor != f1Map.end();
-            itor ++)
-        {
-            AdrMap_t::iterator iNext = itor;
-            iNext ++;
-            if (iNext != f1Map.end())
-            {
-                AdrType_t f1First = itor->first + itor->second;
-                AdrType_t f1Last = iNext->first;
-                if (f1First == f1Last)
-                {
-                    itor->second += iNext->second;
-                    f1Map.erase(iNext);
-                }
-            }
-        }
+private:
+    RunStats(const RunStats &);
+    RunStats &operator = (const RunStats &);
+    struct Totals
+    {
+        Totals() : passes(0), wallSeconds(0), cpuSeconds(0), faults(0), bytes(0), reads(0), readBytes(0),
+            readNanos(0), waitNanos(0) {}
+        unsigned passes;
+        double wallSeconds;
+        double cpuSeconds;
+        long faults;
+        AdrType_t bytes;
+        AdrType_t reads;
+        AdrType_t readBytes;
+        AdrType_t readNanos;
+        AdrType_t waitNanos;
+    };
+    static void usage(double &cpuSeconds, long &faults);
+    void printProgress(AdrType_t done);
+    void endProgress();
 
-        // process -x 
-        bool createdDir = false;
-        for (
-            FileDescMap_t::const_iterator fileItor = FileDescMap.begin();
-            fileItor != FileDescMap.end();
-            fileItor++)
-        {
-            AdrMap_t::const_iterator i1 = f1Map.lower_bound(fileItor->second.pos);
-            if (i1 != f1Map.begin())
-            {
-                i1--;
-                const AdrType_t f1First = i1->first;
-                const AdrType_t f1Last = f1First + i1->second;
-                AdrType_t fiFirst = fileItor->second.pos;
-                AdrType_t fiLast = fileItor->second.pos + fileItor->second.len;
-                if ((fiFirst >= f1First) && (fiLast <= f1Last))
-                {
-                    if (!createdDir)
-                    {
-                        std::string cmd = "mkdir ";
-                        cmd += dirName;
-                        ::system(cmd.c_str());
-                        createdDir = true;
-                    }
-                    std::ofstream out((dirName + "/" + fileItor->first).c_str(), std::ofstream::binary);
-                    if (!out.is_open())
-                    {
-                        throw std::runtime_error(std::string("Cannot create ") + fileItor->first );
-                    }
-                    else
-                    {
-                        for (; fiFirst < fiLast;)
-                        {
-                            f1Iso.clear();
-                            f1Iso.seekg(fiFirst);
-                            AdrType_t toRead = std::min(fiLast - fiFirst, BUFSIZE);
-                            f1Iso.read(buf1, toRead);
-                            if (f1Iso.gcount() != toRead)
-                                throw std::runtime_error(std::string("Oops failed to read ") + fileItor->first);
-                            out.write(buf1, toRead);
-                            fiFirst += toRead;
-                        }
-                        std::cout << "Extracted file " << fileItor->first << std::endl;
-                    }
-                }
-                else
-                    std::cout << "Missing data for " << fileItor->first << " can't extract." << std::endl;
-            }
-        }
+    std::ostream *m_progress;
+    bool m_terminal;
+    long long m_interval;                   // between progress lines, in nanoseconds
+    std::chrono::steady_clock::time_point m_runStart;
+    IoCounters m_io;
+    Totals m_totals[PHASE_COUNT];
+    // the phase running now
+    Phase_t m_phase;
+    std::chrono::steady_clock::time_point m_phaseStart;
+    std::atomic<AdrType_t> m_total;
+    std::atomic<AdrType_t> m_done;
+    std::atomic<long long> m_nextPrint;     // steady_clock nanoseconds at which the next line is due
+    std::mutex m_printLock;
+    size_t m_lineLength;                    // of the line on the terminal, 0 if there is none
+};
 
-        // process -jpeg 
-        // scan the iso for jpeg files 
-        if (!jpgTextName.empty())
-        {
-            std::ofstream ofs(jpgTextName.c_str());
-            if (!ofs.is_open())
-                throw std::runtime_error(std::string("Could not open ") + jpgTextName);
-            int fileCount = 0;
-            for (AdrMap_t::const_iterator itor = f1Map.begin();
-                itor != f1Map.end();
-                itor ++)
-            {
-                enum {NO_FILE, IN_PROGRESS, FOUND_0XFF, 
-                    FOUND_BC0, FOUND_BC1, SKIPPING, COMPLETE} jpgfileInProgress(NO_FILE);
-                AdrType_t f1First = itor->first;
-                AdrType_t f1Last = f1First + itor->second;
+static void reportRate(std::ostream &out, const char *what, AdrType_t bytes,
+    std::chrono::steady_clock::time_point start);
+static void readLog(std::ostream &out, ImageFile &log, const std::string &fname, const std::string &statusChars,
+    WorkPool &pool, ExtentSet &res, MapEntryList_t *entries = 0);
+static AdrType_t firstMismatch(const unsigned char *a, const unsigned char *b, AdrType_t len);
+static CoverageList_t findCoverage(const std::vector<ExtentSet> &maps);
+static unsigned countImages(unsigned images);
+static AdrType_t compareImages(ImageList_t &isos, unsigned images, AdrType_t begin, AdrType_t end,
+    char *bufs, AdrType_t bufSize, ExtentSet *bad = 0, AdrType_t sectorSize = CDROM_BLOCK_SIZE);
+static AdrType_t compareChunk(const unsigned char * const *data, unsigned count, AdrType_t len, AdrType_t pos,
+    ExtentSet *bad, AdrType_t sectorSize = CDROM_BLOCK_SIZE);
+static void diffBlocks(const unsigned char *a, const unsigned char *b, AdrType_t len, AdrType_t pos,
+    ExtentSet &bad, AdrType_t sectorSize);
+static void mergeImages(std::ostream &report, RunStats &stats, ImageList_t &isos, const CoverageList_t &coverage,
+    AdrType_t bufSize, AdrType_t sectorSize, const std::string &mergeName, ExtentSet &badBlocks);
+static void writeCompressed(std::ostream &report, RunStats &stats, WorkPool &pool, ImageFile &iso,
+    const ExtentSet &kept, const std::string &name);
+static void writeMapfile(const std::string &name, const ExtentSet &marked, char mark, char other, AdrType_t size);
+static void writeMapfile(const std::string &name, const MapEntryList_t &entries, char other, AdrType_t size);
+static char mapfileStatus(ImageFile &log);
+static bool makeDirectory(const std::string &name);
+static void parseTriplets(const char *p, const char *end, AdrType_t sectorSize, FileList_t &files);
+static void sortFiles(FileList_t &files);
 
-                long jpgFileLength = 0;
-                long jpgFileBlockNum = 0;
-                int skipping = 0;
-                while (f1First < f1Last)
-                {
-                    f1Iso.clear();
-                    f1Iso.seekg(f1First);
-                    const AdrType_t toRead = std::min(f1Last - f1First, BUFSIZE);
-                    f1Iso.read(buf1, toRead);
-                    if (f1Iso.gcount() != toRead)
-                    {
-                        std::ostringstream oss;
-                        oss << "Failed to read bytes from " << f1IsoName << " at " << 
-                            std::hex << f1First << " length " << std::hex << toRead;
-                        throw std::runtime_error(oss.str());
-                    }
-                    int numBlocks = (int)(toRead/CDROM_BLOCK_SIZE);
-                    for (int i = 0; i < numBlocks; i++)
-                    {
-                        const unsigned char *block = reinterpret_cast<const unsigned char *>(&buf1[i * CDROM_BLOCK_SIZE]);
-                        const unsigned char *p = block;
-                        while (p - block < CDROM_BLOCK_SIZE)
-                        {
-                            switch (jpgfileInProgress)
-                            {
-                            case NO_FILE:
-                                if ((*p++ == 0xFF) && (*p++ == 0xD8) && (*p++ == 0xFF) && (*p++ == 0xE0))
-                                {
-                                    /* this is the only case in the switch where we can assume *p 
-                                    ** is within the current buf1. All the other cases have to deal
-                                    ** with the possiblity that *p is at the end of a CDROM block.
-                                    ** But jpeg file headers will only appear at the beginning of a file,
-                                    ** which, on a CDROM, will only appear at the beginning of a 2048 byte 
-                                    ** block. */
-                                    p += 2;
-                                    if (strcmp((const char *)p, "JFIF") == 0)
-                                    {
-                                        int blockNumNow = (int)(f1First/CDROM_BLOCK_SIZE);
-                                        if (f1First % CDROM_BLOCK_SIZE)
-                                        {
-                                            std::ostringstream oss;
-                                            oss << "oops: ddrescue block not on CDROM block size boundary: " 
-                                                << std::hex << f1First;
-                                            throw std::runtime_error(oss.str());
-                                        }
-                                        int blockSize = (block[5] & 0xFF) | ((block[4] << 8) & 0xFF00);
-                                        // reset our pointer to end of this block
-                                        p = &block[blockSize + 4];
-                                        blockNumNow += i;
-                                        if (blockNumNow == 0x1159)
-                                            jpgFileLength = 0;
-                                        jpgFileBlockNum = blockNumNow;
-                                        jpgFileLength = 0;
-                                        jpgfileInProgress = IN_PROGRESS;
-                                        fileCount += 1;
-                                        std::cout << "jpeg header at block number " << std::hex << blockNumNow << std::endl;
-                                    }
-                                }
-                                break;
-
-                            case IN_PROGRESS:
-                                if (*p++ == 0xFF)
-                                    jpgfileInProgress = FOUND_0XFF;
-                                break;
-
-                            case FOUND_0XFF:
-                                {
-                                    unsigned char c = *p++;
-                                    if (c == 0xD9)
-                                        jpgfileInProgress = COMPLETE;
-                                    else if (c == 0xFF); // do nothing
-                                    else if (c == 0)
-                                        jpgfileInProgress = IN_PROGRESS;
-                                    // http://en.wikipedia.org/wiki/JPEG
-                                    // http://www.fileformat.info/format/jpeg/egff.htm
-                                    else if (((c & 0xF0) == 0xd0) &&
-                                          ((c & 0x0F) <= 7))
-                                    {
-                                        jpgfileInProgress = IN_PROGRESS; 
-                                    }
-                                    else
-                                    {
-                                        unsigned char top4 = c & 0xF0;
-                                        if ((top4 == 0xC0) ||
-                                            (top4 == 0xD0) ||
-                                            (top4 == 0xE0) ||
-                                            (top4 == 0xF0))
-                                        {
-                                            jpgfileInProgress = FOUND_BC0;
-                                            skipping = 0;
-                                        }
-                                        else
-                                        {
-                                            jpgfileInProgress = IN_PROGRESS;
-                                        }
-                                    }
-                                }
-                                break;
-
-                            case FOUND_BC0:
-                                skipping += *p++;
-                                jpgfileInProgress = FOUND_BC1;
-                                break;
-
-                            case FOUND_BC1:
-                                skipping <<= 8;
-                                skipping |= *p++;
-                                skipping -= 2;
-                                if (skipping > 0)
-                                    jpgfileInProgress = SKIPPING;
-                                else
-                                    jpgfileInProgress = IN_PROGRESS; // tests don't get here
-                                break;
-
-                            case SKIPPING:
-                                p++;
-                                skipping -= 1;
-                                if (skipping <= 0)
-                                    jpgfileInProgress = IN_PROGRESS;
-                                break;
-
-                            }
-                            if (jpgfileInProgress == COMPLETE)
-                            {
-                                jpgfileInProgress = NO_FILE;
-                                jpgFileLength += static_cast<int>(p - block);
-                                ofs << "] " << std::hex << jpgFileBlockNum << " " << std::dec << 
-                                    jpgFileLength << " 00/ File" << 
-                                    fileCount << ".jpg;1" << std::endl;
-                                break;  // file can only start on block boundary
-                            }
-                            else if (jpgfileInProgress == NO_FILE)
-                                break;
-                        }
-                        jpgFileLength += CDROM_BLOCK_SIZE;
-                    }
-                    f1First += toRead;
-               }
-            }
-        }
-    }
-    catch (const std::exception &e)
+// how much of an image each read moves
+static const AdrType_t BUFSIZE = CDROM_BLOCK_SIZE * 1024;
+
+/* The loops that step through an image a sector at a time are templates on the sector size N.
+** sectorKernel picks the one for a --sector-size: the usual sizes have their own, whose loops
+** have a constant stride the compiler can unroll, and N == 0 is the fallback for any other
+** size, which takes it at run time. Each kernel also takes sectorSize, which the fixed ones
+** ignore. SECTOR_KERNELS(f) lists f's instantiations in the order sectorKernel wants them. */
+#define SECTOR_KERNELS(f) &f<512>, &f<2048>, &f<2352>, &f<4096>, &f<0>
+template <typename Fn>
+static Fn sectorKernel(AdrType_t sectorSize, Fn f512, Fn f2048, Fn f2352, Fn f4096, Fn generic)
+{
+    switch (sectorSize)
     {
-        std::cerr << e.what() << std::endl;
-        ret = -1;
+    case 512: return f512;
+    case 2048: return f2048;
+    case 2352: return f2352;
+    case 4096: return f4096;
+    default: return generic;
     }
-
-    delete [] buf1;
-    delete [] buf2;
-    return ret;
+}
+// a sector kernel's sector size: N, or the one it was given
+template <unsigned N>
+static inline AdrType_t kernelSectorSize(AdrType_t sectorSize)
+{
+    return N ? N : sectorSize;
 }
 
-// parse the ddrescue log file for what we want from it.
-void readLog(std::ifstream &instr, const std::string &fname, AdrMap_t &res)
+// what the command line asked for
+struct Options
+{
+    Options() : useFilesystem(false), partial(false), checkEcc(false), useIndex(false), follow(false), ioPolicy(IO_CACHED),
+        sectorSize(CDROM_BLOCK_SIZE), threadCount(1), statusChars("+"), perDevice(1), statsJson(false) {}
+    std::string f1Name;                 // without the .iso or .log
+    std::vector<std::string> cmpNames;  // each -c
+    std::string dirName;
+    bool useFilesystem;                 // -fs: the -x files come from the iso's own directories
+    std::string domainName;
+    bool partial;                       // -partial: -x writes what there is of files not wholly rescued
+    std::string jpgTextName;
+    std::string carveTextName;
+    std::string diffName;
+    std::string mergeName;
+    std::string gzName;                 // -gz: write <f1> as gzName.iso.gz, a compressed image
+    std::string edcName;
+    bool checkEcc;                      // -ecc: -edc checks the P and Q parity too
+    bool useIndex;
+    bool follow;
+    IoPolicy_t ioPolicy;
+    AdrType_t sectorSize;               // of the device ddrescue read. Triplet block numbers count these.
+    unsigned threadCount;
+    std::string statusChars;
+    std::string batchName;              // -batch: the job file
+    unsigned perDevice;                 // -batch jobs reading .iso files on one device at a time
+    bool statsJson;                     // --stats=json: what each phase cost, on stderr at the end
+};
+
+enum JpegState_t {NO_FILE, IN_PROGRESS, FOUND_0XFF, FOUND_BC0, FOUND_BC1, SKIPPING, COMPLETE};
+
+/* How far the -jpg scan of an extent got. --follow keeps the one for the end of each extent,
+** so when ddrescue adds to the end of an extent the scan carries on from there. */
+struct JpegScan
+{
+    JpegScan() : pos(0), state(NO_FILE), fileLength(0), fileBlockNum(0), skipping(0) {}
+    AdrType_t pos;      // the next address to scan
+    JpegState_t state;
+    long fileLength;
+    long fileBlockNum;
+    int skipping;
+};
+
+/* What a scan of an extent for files found. Extents are scanned in parallel, so these are kept
+** until the extents before have been written out, to number and write the files in address order. */
+struct CarveHit
+{
+    enum Kind_t {HEADER, FILE_END, MISALIGNED};
+    Kind_t kind;
+    int rule;           // which of CARVE_RULES
+    AdrType_t block;    // of the file's header. For MISALIGNED, the address of the chunk.
+    AdrType_t length;
+};
+typedef std::vector<CarveHit> CarveHitList_t;
+
+// how -carve finds where a file ends
+enum CarveEnd_t
+{
+    END_SIZE_FIELD,     // a RIFF header's size covers the rest of the file
+    END_JPEG,           // walk the markers, jumping over segments, to EOI
+    END_PNG,            // walk the chunks to IEND
+    END_FOOTER,         // the end of the first footer
+    END_ZIP,            // the end of central directory record and its comment
+    END_MP3             // an ID3 tag, then MPEG audio frames as long as they last
+};
+
+/* One kind of file -carve looks for. A file starts at the beginning of a CDROM block with magic,
+** and tag, if there is one, is tagOffset bytes into it. */
+struct CarveRule
+{
+    const char *name;       // for messages
+    const char *ext;        // for the triplet's file name
+    const char *magic;
+    unsigned magicLen;
+    unsigned tagOffset;
+    const char *tag;
+    unsigned tagLen;
+    CarveEnd_t end;
+    const char *footer;
+    unsigned footerLen;
+    AdrType_t maxLen;       // give up on a file that runs on longer than this
+};
+
+/* The files -carve recognizes. More go at the end: each block is only tested against
+** the rules whose magic starts with its first byte, so more rules cost no more reading.
+** -jpg reports its files as the first one. */
+static const CarveRule CARVE_RULES[] =
+{
+    { "jpeg", "jpg", "\xFF\xD8\xFF\xE0", 4, 6, "JFIF", 5, END_JPEG, 0, 0, 64 << 20 },
+    { "jpeg", "jpg", "\xFF\xD8\xFF\xE1", 4, 6, "Exif", 5, END_JPEG, 0, 0, 64 << 20 },
+    { "png", "png", "\x89PNG\r\n\x1A\n", 8, 0, 0, 0, END_PNG, 0, 0, 256 << 20 },
+    { "pdf", "pdf", "%PDF-", 5, 0, 0, 0, END_FOOTER, "%%EOF", 5, 1u << 30 },
+    { "zip", "zip", "PK\x03\x04", 4, 0, 0, 0, END_ZIP, "PK\x05\x06", 4, 4ull << 30 },
+    { "mp3", "mp3", "ID3", 3, 0, 0, 0, END_MP3, 0, 0, 256 << 20 },
+    { "avi", "avi", "RIFF", 4, 8, "AVI ", 4, END_SIZE_FIELD, 0, 0, 4ull << 30 },
+    { "wav", "wav", "RIFF", 4, 8, "WAVE", 4, END_SIZE_FIELD, 0, 0, 4ull << 30 },
+};
+static const size_t CARVE_RULE_COUNT = sizeof(CARVE_RULES) / sizeof(CARVE_RULES[0]);
+
+/* How far the -carve scan of an extent got, kept like JpegScan. */
+struct CarveScan
+{
+    CarveScan() : pos(0), rule(-1), fileStart(0), state(0), skip(0), heldLen(0), footerMatched(0) {}
+    AdrType_t pos;          // the next address to scan
+    int rule;               // of the file in progress, or -1 for none
+    AdrType_t fileStart;
+    int state;              // where in the file the rule's end finder is
+    AdrType_t skip;         // bytes to pass over before it looks again
+    unsigned char held[8];  // a field that may start in one chunk and finish in the next
+    unsigned heldLen;
+    unsigned footerMatched; // bytes of the footer seen so far
+};
+
+// the triplet file written by -jpg or -carve, and what has gone into it
+struct CarveOutput
+{
+    CarveOutput() : count(0) {}
+    std::ofstream text;
+    int count;
+    std::map<long, int> numbers;    // the block of each header found, and its file number
+    std::set<long> written;         // the blocks of the files written to text
+};
+
+/* How far the -edc check of an extent got. Extents are trimmed to whole sectors, so a pass
+** always stops at the end of one. */
+struct EdcScan
+{
+    EdcScan() : pos(0) {}
+    AdrType_t pos;      // the next address to check
+};
+
+// what -edc found in an extent, or added up over all of them
+struct RawSectorCheck
+{
+    RawSectorCheck() : mode1(0), form1(0), form2(0), unchecked(0) {}
+    AdrType_t mode1;        // the sectors that checked out, by kind
+    AdrType_t form1;
+    AdrType_t form2;
+    AdrType_t unchecked;    // audio, Mode 0, formless Mode 2 and Form 2 without an EDC
+    ExtentSet bad;
+};
+
+template <unsigned N>
+static void scanJpegChunk(const unsigned char *data, AdrType_t pos, AdrType_t len, JpegScan &scan,
+    CarveHitList_t &hits, AdrType_t sectorSize);
+template <bool ECC>
+static void verifyRawSectors(const unsigned char *data, AdrType_t pos, AdrType_t len, EdcScan &scan,
+    RawSectorCheck &check, AdrType_t sectorSize);
+template <unsigned N>
+static void scanCarveChunk(const unsigned char *data, AdrType_t pos, AdrType_t len, CarveScan &scan,
+    CarveHitList_t &hits, AdrType_t sectorSize);
+
+/* Waits for ddrescue to rewrite one of its mapfiles. On linux, inotify watches the directories
+** the mapfiles are in, which catches a mapfile replaced by a rename as well as one rewritten
+** in place. Elsewhere, or if inotify can't be had, it polls. */
+class LogWatcher
 {
-    std::string lineBuf;
-    bool skippedOne = false;
-    AdrType_t totalBytes(0);
-    while (std::getline(instr, lineBuf))
+public:
+    explicit LogWatcher(const std::vector<std::string> &names);
+    ~LogWatcher();
+    void wait();
+private:
+    LogWatcher(const LogWatcher &);
+    LogWatcher &operator = (const LogWatcher &);
+    std::vector<std::string> m_names;
+#if defined(DDRESCUECMP_LINUX)
+    int m_fd;
+    std::vector<int> m_watches;         // the watch on the directory of each name
+    std::vector<std::string> m_leaves;  // each name without its directory
+#endif
+#if defined(DDRESCUECMP_POSIX)
+    // true if any of the files' modification time or size changed since the last call
+    bool changed();
+    std::vector<std::pair<AdrType_t, AdrType_t> > m_stamps;
+#endif
+};
+
+/* The -fs file list: the directories of an ISO9660 image, read from <f1>.iso itself instead of
+** from an isodump listing. Only rescued sectors are read, and of those only the volume
+** descriptors, the path table and the directories. Names come from Rock Ridge when the disc
+** has it, else from the Joliet tree when there is one, else they are the plain ISO9660 names.
+** A directory whose sectors weren't rescued can't be listed. The path table still locates the
+** directories below it, so any of those that were rescued are listed anyway. */
+class IsoFilesystem
+{
+public:
+    IsoFilesystem(std::ostream &out, ImageFile &iso, const ExtentSet &rescued);
+    // every file in every directory that could be read, by its full path. false if no
+    // volume descriptor could be read.
+    bool read(FileList_t &files);
+    // the directories that could not be read, by their full paths
+    const std::vector<std::string> &unreadable() const { return m_unreadable; }
+    // where those directories are. A directory whose size isn't known is given one block.
+    const ExtentList_t &unreadableExtents() const { return m_unreadableExtents; }
+    size_t directories() const { return m_paths.size() - m_unreadable.size(); }
+    const char *kind() const { return m_rockRidge ? "Rock Ridge" : m_joliet ? "Joliet" : "ISO9660"; }
+private:
+    IsoFilesystem(const IsoFilesystem &);
+    IsoFilesystem &operator = (const IsoFilesystem &);
+    struct Directory
     {
-        if (lineBuf.empty()) continue;
-        if (lineBuf[0] == '#') continue;
-        if (!skippedOne) { skippedOne = true; continue; }
-        AdrType_t addr(0);
-        AdrType_t len(0);
-        char stat('-');
-        if (sscanf(lineBuf.c_str(), "%lx %lx %c", &addr, &len, &stat) != 3)
-            continue;
-        if (stat != '+') continue;
+        AdrType_t block;
+        AdrType_t len;      // 0 when not known yet: the "." entry in the first block says
+        std::string path;
+        Directory(AdrType_t b, AdrType_t l, const std::string &p) : block(b), len(l), path(p) {}
+    };
+    // len bytes at pos into buf, but only if they were rescued
+    bool readRescued(AdrType_t pos, AdrType_t len, std::vector<unsigned char> &buf);
+    bool readVolumeDescriptors(std::vector<unsigned char> &pvd, std::vector<unsigned char> &svd);
+    void walk(std::vector<Directory> &pending, FileList_t &files);
+    void listDirectory(const Directory &dir, std::vector<Directory> &pending, FileList_t &files);
+    void readPathTable(const std::vector<unsigned char> &vd, std::vector<Directory> &dirs);
+    std::string recordName(const unsigned char *rec);
+    void rockRidgeName(const unsigned char *p, size_t len, std::string &name, int depth);
 
-        if (len == 0)
-        {
-            std::ostringstream oss;
-            oss << "oops got zero length in log \"" << lineBuf << "\"";
-            throw std::runtime_error(oss.str());
-        }
+    std::ostream &m_out;
+    ImageFile &m_iso;
+    const ExtentSet &m_rescued;
+    AdrType_t m_blockSize;
+    bool m_joliet;
+    bool m_rockRidge;
+    unsigned m_suspSkip;                // bytes before the Rock Ridge entries in each record
+    std::map<AdrType_t, std::string> m_paths;   // each directory found so far, listed or not, by block
+    std::vector<std::string> m_unreadable;
+    ExtentList_t m_unreadableExtents;
+};
 
-        if (!res.empty())
-        {
-            AdrMap_t::iterator itor = res.lower_bound(addr);    // first entry not before
+/* -batch: a job file of command lines, one disc each, run in the one process. Up to -j jobs
+** run at once, but no more than --per-device of them read .iso files on the same device, so
+** each drive of an array streams one image at a time rather than seeking between several.
+** A job's output is held until it is done and then printed whole. A summary of every job
+** comes at the end. */
+class BatchRun
+{
+public:
+    explicit BatchRun(const Options &opts);
+    // 0, or -1 when a job failed or didn't match
+    int run();
+private:
+    BatchRun(const BatchRun &);
+    BatchRun &operator = (const BatchRun &);
+    struct Job
+    {
+        Job() : started(false), ret(0), seconds(0) {}
+        std::string line;
+        Options opts;
+        std::vector<unsigned long long> devices;    // that its .iso files are on
+        bool started;
+        int ret;
+        double seconds;
+    };
+    bool readJobs();
+    void runJobs();
+    bool startJob(size_t &i);
+    void finishJob(size_t i, const std::string &output);
 
-            if (itor != res.end())
-            {
-                if (itor->first <= (addr + len))
-                {
-                    std::ostringstream oss;
-                    oss << "oops overlap of existing 0x" << std::hex << itor->first << 
-                        " 0x" << std::hex << itor->second << 
-                        " with 0x" << std::hex << addr << " 0x" <<  std::hex << len;
-                    throw std::runtime_error(oss.str());
-                }
-            }
+    const Options &m_opts;
+    std::vector<Job> m_jobs;
+    std::mutex m_lock;
+    std::condition_variable m_finished;             // a job is done, so its devices may have room
+    std::map<unsigned long long, unsigned> m_busy;  // the jobs running on each device
+};
 
-            if (itor != res.begin())
-            {
-                itor--;
-                if (addr <= itor->first + itor->second)
-                {
-                    std::ostringstream oss;
-                    oss << "oops overlap of existing 0x" << std::hex << itor->first << 
-                        " 0x" << std::hex << itor->second << 
-                        " with 0x" << std::hex << addr << " 0x" << std::hex << len;
-                    throw std::runtime_error(oss.str());
-                }
-            }
-        }
+/* The checks the command line asked for on <f1> and its -c images: compare, -x and -jpg.
+** Without --follow that is one pass. With it, there is another pass each time ddrescue rewrites
+** a mapfile, and each pass only looks at what ddrescue finished since the one before. */
+class RescueCheck
+{
+public:
+    // what it finds goes to out, and what goes wrong to err. progress, if given, gets the progress line.
+    RescueCheck(const Options &opts, WorkPool &pool, std::ostream &out, std::ostream &err,
+        std::ostream *progress = 0);
+    // 0, or -1 when something failed or didn't match
+    int run();
+private:
+    RescueCheck(const RescueCheck &);
+    RescueCheck &operator = (const RescueCheck &);
+    bool open();
+    void readDir();
+    void readFilesystem(const ExtentSet &f1Map, bool last);
+    bool readLogs(std::vector<ExtentSet> &maps, std::vector<MapEntryList_t> &entries);
+    void findHoles(const std::vector<ExtentSet> &maps);
+    void compare(const std::vector<ExtentSet> &maps, const std::vector<MapEntryList_t> &entries,
+        const ExtentSet *fresh);
+    void extract(const ExtentSet &f1Map, bool last);
+    void writeDomain(const ExtentSet &f1Map, bool last);
+    void scanJpeg(const ExtentSet &f1Map);
+    void carve(const ExtentSet &f1Map);
+    void compress();
+    void verifyEdc(const ExtentSet &f1Map);
+    template <typename Scan, typename Hits, typename ScanChunk>
+    AdrType_t scanExtents(const ExtentSet &f1Map, std::map<AdrType_t, Scan> &scans, ScanChunk scanChunk,
+        std::vector<Hits> &hits);
+    void writeHits(const std::string &name, CarveOutput &out, const std::vector<CarveHitList_t> &hits);
+
+    const Options &m_opts;
+    WorkPool &m_pool;
+    std::ostream &m_out;
+    std::ostream &m_err;
+    // f1 is image 0, followed by each -c image
+    std::vector<std::string> m_isoNames;
+    std::vector<std::string> m_logNames;
+    std::vector<std::string> m_idxNames;
+    ImageList_t m_isos;
+    ImageList_t m_logs;
+    std::vector<ExtentSet> m_holes;     // of each image
+    FileList_t m_files;
+    std::set<std::string> m_extracted;  // the m_files -x has written
+    ExtentList_t m_lostDirs;            // -fs directories not rescued yet
+    bool m_createdDir;
+    ExtentSet m_badBlocks;              // -diff mismatches found so far
+    CarveOutput m_jpg;
+    std::map<AdrType_t, JpegScan> m_jpgScans;   // by the start of the extent scanned
+    CarveOutput m_carve;
+    std::map<AdrType_t, CarveScan> m_carveScans;
+    RawSectorCheck m_edc;               // -edc, over every pass so far
+    std::map<AdrType_t, EdcScan> m_edcScans;
+    RunStats m_stats;
+    int m_ret;
+};
+
+// the image of the rescue f: f.iso, or f.iso.gz, a -gz image, if only that is there
+static std::string imageName(const std::string &f)
+{
+    const std::string iso = f + ".iso";
+    if (std::ifstream(iso.c_str()).is_open() || !std::ifstream((iso + ".gz").c_str()).is_open())
+        return iso;
+    return iso + ".gz";
+}
 
-        res[addr] = len;
-        totalBytes += len;
+// the arguments of the command line, or of a -batch job, into opts. false if they don't make sense.
+static bool parseOptions(const std::vector<std::string> &args, Options &opts)
+{
+    bool minusC = false;
+    bool minusX = false;
+    bool minusJpg = false;
+    bool minusCarve = false;
+    bool minusJ = false;
+    bool minusDiff = false;
+    bool minusMerge = false;
+    bool minusDomain = false;
+    bool minusEdc = false;
+    bool minusGz = false;
+    bool minusBatch = false;
+    bool sectorSizeGiven = false;
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        const std::string &arg = args[i];
+        if (minusC)
+        {
+            minusC = false;
+            opts.cmpNames.push_back(arg);
+        }
+        else if (minusX)
+        {
+            minusX = false;
+            opts.dirName = arg;
+        }
+        else if (minusJpg)
+        {
+            minusJpg = false;
+            opts.jpgTextName = arg;
+        }
+        else if (minusCarve)
+        {
+            minusCarve = false;
+            opts.carveTextName = arg;
+        }
+        else if (minusMerge)
+        {
+            minusMerge = false;
+            opts.mergeName = arg;
+        }
+        else if (minusDomain)
+        {
+            minusDomain = false;
+            opts.domainName = arg;
+        }
+        else if (minusDiff)
+        {
+            minusDiff = false;
+            opts.diffName = arg;
+        }
+        else if (minusEdc)
+        {
+            minusEdc = false;
+            opts.edcName = arg;
+        }
+        else if (minusGz)
+        {
+            minusGz = false;
+            opts.gzName = arg;
+        }
+        else if (minusBatch)
+        {
+            minusBatch = false;
+            opts.batchName = arg;
+        }
+        else if (minusJ)
+        {
+            minusJ = false;
+            opts.threadCount = static_cast<unsigned>(atoi(arg.c_str()));
+            if (opts.threadCount == 0)
+                return false;
+        }
+        else if (arg == "-c")
+            minusC = true;
+        else if (arg == "-x")
+            minusX = true;
+        else if (arg == "-jpg")
+            minusJpg = true;
+        else if (arg == "-carve")
+            minusCarve = true;
+        else if (arg == "-j")
+            minusJ = true;
+        else if (arg == "-diff")
+            minusDiff = true;
+        else if (arg == "-merge")
+            minusMerge = true;
+        else if (arg == "-gz")
+            minusGz = true;
+        else if (arg == "-fs")
+            opts.useFilesystem = true;
+        else if (arg == "-domain")
+            minusDomain = true;
+        else if (arg == "-partial")
+            opts.partial = true;
+        else if (arg == "-edc")
+            minusEdc = true;
+        else if (arg == "-ecc")
+            opts.checkEcc = true;
+        else if (arg == "-idx")
+            opts.useIndex = true;
+        else if (arg == "-batch")
+            minusBatch = true;
+        else if (arg.compare(0, 13, "--per-device=") == 0)
+        {
+            opts.perDevice = static_cast<unsigned>(atoi(arg.c_str() + 13));
+            if (opts.perDevice == 0)
+                return false;
+        }
+        else if (arg == "--follow")
+            opts.follow = true;
+        else if (arg == "--io=cached")
+            opts.ioPolicy = IO_CACHED;
+        else if (arg == "--io=stream")
+            opts.ioPolicy = IO_STREAM;
+        else if (arg == "--io=direct")
+            opts.ioPolicy = IO_DIRECT;
+        else if (arg == "--stats=json")
+            opts.statsJson = true;
+        else if (arg.compare(0, 14, "--sector-size=") == 0)
+        {
+            opts.sectorSize = strtoull(arg.c_str() + 14, 0, 10);
+            sectorSizeGiven = true;
+            if ((opts.sectorSize < 512) || (opts.sectorSize > BUFSIZE))
+                return false;
+        }
+        else if (arg.compare(0, 9, "--status=") == 0)
+        {
+            opts.statusChars = arg.substr(9);
+            if (opts.statusChars.empty() || (opts.statusChars.find_first_not_of("?*/-+") != opts.statusChars.npos))
+                return false;
+        }
+        else
+        {
+            if (!opts.f1Name.empty())
+                return false;
+            opts.f1Name = arg;
+        }
     }
-    instr.close();
-    std::cout << "Total bytes rescued in \"" << fname << "\" " << totalBytes << std::endl;
-}
\ No newline at end of file
+    if (minusC || minusX || minusJpg || minusCarve || minusJ || minusDiff || minusMerge || minusDomain || minusEdc ||
+        minusGz || minusBatch)
+        return false;
+    if ((!opts.diffName.empty() || !opts.mergeName.empty()) && opts.cmpNames.empty())
+        return false;
+    if (opts.cmpNames.size() >= MAX_IMAGES)
+        return false;
+    if (opts.follow && (!opts.mergeName.empty() || !opts.gzName.empty()))
+        return false;
+    if ((opts.useFilesystem || !opts.domainName.empty() || opts.partial) && opts.dirName.empty())
+        return false;
+    if (opts.checkEcc && opts.edcName.empty())
+        return false;
+    if (!opts.edcName.empty())
+    {   // only raw sectors have an EDC
+        if (sectorSizeGiven && (opts.sectorSize != RAW_SECTOR_SIZE))
+            return false;
+        opts.sectorSize = RAW_SECTOR_SIZE;
+    }
+    // a -batch job file, or one <f1>, but not both
+    return opts.f1Name.empty() != opts.batchName.empty();
+}
+
+// bench/BenchCmp.cpp includes this file to time its functions, and has a main of its own
+#if !defined(DDRESCUECMP_NO_MAIN)
+int main(int argc, char * argv[])
+{
+    Options opts;
+    if (!parseOptions(std::vector<std::string>(argv + 1, argv + argc), opts))
+    {
+        std::cerr << "usage: ddrescuecmp <f1> [-c F2]... [-x DIR [-fs] [-domain MAP] [-partial]] [-jpg JPG] [-carve TXT] [-j N] [--status=+] [-diff MAP] [-merge OUT] [-gz OUT] [-edc MAP [-ecc]] [-idx] [--follow] [--io=cached|stream|direct] [--sector-size=2048] [--stats=json]" << std::endl
+            << "  These must exist: <f1>.iso <f1>.log, or for a -gz image, <f1>.iso.gz <f1>.log" << std::endl
+            << "  and for -c, the files F2.iso F2.log must exist. -c may be repeated." << std::endl
+            << "  and for -x, the file DIR.txt must exist." << std::endl
+            << "  DIR.txt is edited from linux utility isodump." << std::endl
+            << " -fs lists the -x files from the ISO9660, Joliet or Rock Ridge directories in <f1>.iso instead of DIR.txt." << std::endl
+            << " -domain writes the blocks of the -x files not yet rescued to MAP, a domain mapfile for ddrescue -m." << std::endl
+            << " -partial has -x write files only partly rescued as sparse files, each with a mapfile of its gaps." << std::endl
+            << " -jpg scans <f1>.iso for jpeg file headers and creates the file JPG, which will then work -x" << std::endl
+            << " -carve is -jpg for jpeg, png, pdf, zip, mp3, avi and wav files, all in one scan, and creates the file TXT." << std::endl
+            << " -j runs the -c compare, the -jpg and -carve scans and the -x extraction on N threads." << std::endl
+            << " -diff compares every overlapping block for -c and writes the mismatches to the ddrescue mapfile MAP." << std::endl
+            << " -merge writes OUT.iso and OUT.log, taking each block by majority vote of the -c images." << std::endl
+            << " -gz writes OUT.iso.gz, <f1>.iso compressed without what ddrescue hasn't tried ('?'), and OUT.log, a copy of <f1>.log." << std::endl
+            << " -edc checks the EDC of each rescued raw sector in <f1>.iso and writes those that fail to the ddrescue mapfile MAP." << std::endl
+            << "  Audio, Mode 0, Form 2 without an EDC and Mode 2 without a subheader (formless) can't be checked and are only counted." << std::endl
+            << " -ecc has -edc check each sector's P and Q parity as well." << std::endl
+            << " -idx keeps a hash of every block in <f1>.idx and F2.idx, and -c only reads blocks whose hashes differ." << std::endl
+            << " --status selects which ddrescue mapfile status characters (?*/-+) count as rescued." << std::endl
+            << " --follow keeps running while ddrescue updates the .log files, checking only what it newly rescued." << std::endl
+            << "  It stops when ddrescue has finished all of them. It can't be used with -merge or -gz." << std::endl
+            << " --io=stream reads the .iso files without keeping them in the page cache, and --io=direct with O_DIRECT." << std::endl
+            << " --sector-size is the size of the sectors of the device rescued: 2048 for a CDROM or DVD, 2352 for" << std::endl
+            << "  a raw CD, 512 or 4096 for a disk. Blocks in -diff, -merge, -jpg, -carve and DIR.txt are sectors." << std::endl
+            << " --stats=json writes the time, CPU, reads and MB/s of each phase to stderr at the end." << std::endl
+            << "   or: ddrescuecmp -batch JOBS [-j N] [--per-device=1] [OPTION]..." << std::endl
+            << " -batch runs each line of JOBS, a command line like the one above, N jobs at a time and no more than" << std::endl
+            << "  --per-device of them reading .iso files on any one device. Each job runs on one thread unless it has -j." << std::endl
+            << "  Other OPTIONs apply to every job. A job can't use --follow." << std::endl;
+        return 1;
+    }
+
+    if (!opts.batchName.empty())
+    {
+        BatchRun batch(opts);
+        return batch.run();
+    }
+    WorkPool pool(opts.threadCount);
+    RescueCheck check(opts, pool, std::cout, std::cerr, &std::cerr);
+    return check.run();
+}
+#endif
+
+BatchRun::BatchRun(const Options &opts) : m_opts(opts)
+{
+}
+
+int BatchRun::run()
+{
+    if (!readJobs())
+        return -1;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const unsigned n = static_cast<unsigned>(std::min<size_t>(m_opts.threadCount, m_jobs.size()));
+    std::vector<std::thread> runners;
+    for (unsigned r = 1; r < n; r++)
+        runners.push_back(std::thread(&BatchRun::runJobs, this));
+    runJobs();
+    for (size_t r = 0; r < runners.size(); r++)
+        runners[r].join();
+
+    size_t failed = 0;
+    for (size_t i = 0; i < m_jobs.size(); i++)
+        if (m_jobs[i].ret)
+            failed++;
+    std::cout << "Batch " << m_opts.batchName << ": " << std::dec << m_jobs.size() << " jobs, " << failed <<
+        " failed, in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() <<
+        " seconds" << std::endl;
+    for (size_t i = 0; i < m_jobs.size(); i++)
+        std::cout << (m_jobs[i].ret ? "  FAILED " : "  ok     ") << std::fixed << std::setprecision(1) <<
+            std::setw(8) << m_jobs[i].seconds << "s  " << m_jobs[i].line << std::endl;
+    return failed ? -1 : 0;
+}
+
+// each line of the job file that isn't blank or a # comment is a job
+bool BatchRun::readJobs()
+{
+    std::ifstream ifs(m_opts.batchName.c_str());
+    if (!ifs.is_open())
+    {
+        std::cerr << "Failed to read " << m_opts.batchName << std::endl;
+        return false;
+    }
+    // a job starts from the options given with -batch, but with one thread of its own
+    Options defaults(m_opts);
+    defaults.batchName.clear();
+    defaults.threadCount = 1;
+    std::string line;
+    for (int lineNum = 1; std::getline(ifs, line); lineNum++)
+    {
+        std::istringstream words(line);
+        std::vector<std::string> args;
+        std::string arg;
+        while (words >> arg)
+            args.push_back(arg);
+        if (args.empty() || (args[0][0] == '#'))
+            continue;
+        Job job;
+        job.opts = defaults;
+        if (!parseOptions(args, job.opts) || job.opts.follow)
+        {
+            std::cerr << m_opts.batchName << " line " << lineNum << " isn't a job: " << line << std::endl;
+            return false;
+        }
+        for (size_t i = 0; i < args.size(); i++)
+            job.line += (i ? " " : "") + args[i];
+        std::vector<std::string> names(1, job.opts.f1Name);
+        names.insert(names.end(), job.opts.cmpNames.begin(), job.opts.cmpNames.end());
+        for (size_t i = 0; i < names.size(); i++)
+        {   // one that isn't there fails when the job opens it
+#if defined(DDRESCUECMP_POSIX)
+            struct stat st;
+            if (::stat(imageName(names[i]).c_str(), &st) == 0)
+#else
+            struct _stat64 st;      // st_dev is the drive
+            if (::_stat64(imageName(names[i]).c_str(), &st) == 0)
+#endif
+                job.devices.push_back(static_cast<unsigned long long>(st.st_dev));
+        }
+        std::sort(job.devices.begin(), job.devices.end());
+        job.devices.erase(std::unique(job.devices.begin(), job.devices.end()), job.devices.end());
+        m_jobs.push_back(job);
+    }
+    if (m_jobs.empty())
+    {
+        std::cerr << "No jobs in " << m_opts.batchName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// each runner thread takes the jobs it can until there are none left to start
+void BatchRun::runJobs()
+{
+    size_t i;
+    while (startJob(i))
+    {
+        Job &job = m_jobs[i];
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::ostringstream output;
+        try {
+            WorkPool pool(job.opts.threadCount);
+            RescueCheck check(job.opts, pool, output, output);
+            job.ret = check.run();
+        }
+        catch (const std::exception &e)
+        {
+            output << e.what() << std::endl;
+            job.ret = -1;
+        }
+        job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        finishJob(i, output.str());
+    }
+}
+
+// the first job not yet started whose devices all have room, waiting for a job to finish
+// if none has. false once every job has started.
+bool BatchRun::startJob(size_t &i)
+{
+    std::unique_lock<std::mutex> g(m_lock);
+    for (;;)
+    {
+        bool waiting = false;
+        for (i = 0; i < m_jobs.size(); i++)
+        {
+            Job &job = m_jobs[i];
+            if (job.started)
+                continue;
+            waiting = true;
+            bool room = true;
+            for (size_t d = 0; d < job.devices.size(); d++)
+                if (m_busy[job.devices[d]] >= m_opts.perDevice)
+                    room = false;
+            if (room)
+            {
+                job.started = true;
+                for (size_t d = 0; d < job.devices.size(); d++)
+                    m_busy[job.devices[d]]++;
+                return true;
+            }
+        }
+        if (!waiting)
+            return false;
+        m_finished.wait(g);
+    }
+}
+
+void BatchRun::finishJob(size_t i, const std::string &output)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    const Job &job = m_jobs[i];
+    for (size_t d = 0; d < job.devices.size(); d++)
+        m_busy[job.devices[d]]--;
+    std::cout << "== " << job.line << std::endl << output << std::flush;
+    m_finished.notify_all();
+}
+
+RescueCheck::RescueCheck(const Options &opts, WorkPool &pool, std::ostream &out, std::ostream &err,
+    std::ostream *progress) :
+    m_opts(opts), m_pool(pool), m_out(out), m_err(err),
+    m_isoNames(1, imageName(opts.f1Name)), m_logNames(1, opts.f1Name + ".log"), m_idxNames(1, opts.f1Name + ".idx"),
+    m_createdDir(false), m_stats(progress), m_ret(0)
+{
+    for (size_t i = 0; i < opts.cmpNames.size(); i++)
+    {
+        m_isoNames.push_back(imageName(opts.cmpNames[i]));
+        m_logNames.push_back(opts.cmpNames[i] + ".log");
+        m_idxNames.push_back(opts.cmpNames[i] + ".idx");
+    }
+}
+
+int RescueCheck::run()
+{
+    if (!open())
+        return -1;
+
+    try {
+        readDir();
+
+        // watch before the first read, so no rewrite of a mapfile gets by unseen
+        std::unique_ptr<LogWatcher> watcher;
+        if (m_opts.follow)
+            watcher.reset(new LogWatcher(m_logNames));
+
+        std::vector<ExtentSet> seen;    // each image's map as of the last pass
+        for (bool first = true; ; first = false)
+        {
+            if (!first)
+            {
+                m_out << "Waiting for ddrescue to update " << m_logNames[0];
+                if (m_logNames.size() > 1)
+                    m_out << " or the -c mapfiles";
+                m_out << std::endl;
+                watcher->wait();
+                // the images have grown, so map them again
+                if (!open())
+                    return -1;
+            }
+
+            std::vector<ExtentSet> maps(m_isos.size());
+            std::vector<MapEntryList_t> entries(m_opts.useIndex ? m_isos.size() : 0);
+            bool finished;
+            try {
+                finished = readLogs(maps, entries);
+            }
+            catch (const std::runtime_error &e)
+            {   // likely caught ddrescue part way through writing. There will be another.
+                if (first)
+                    throw;
+                m_err << e.what() << std::endl;
+                continue;
+            }
+            const bool last = !m_opts.follow || finished;
+            findHoles(maps);
+
+            // what any image has rescued since the last pass
+            ExtentSet fresh;
+            if (!first)
+            {
+                for (size_t i = 0; i < maps.size(); i++)
+                    fresh = ExtentSet::unite(fresh, ExtentSet::subtract(maps[i], seen[i]));
+                m_out << "Newly rescued " << std::dec << fresh.totalBytes() << " bytes" << std::endl;
+            }
+
+            compare(maps, entries, first ? 0 : &fresh);
+
+            compress();
+            verifyEdc(maps[0]);
+            readFilesystem(maps[0], last);
+            extract(maps[0], last);
+            writeDomain(maps[0], last);
+            scanJpeg(maps[0]);
+            carve(maps[0]);
+
+            if (last)
+                break;
+            seen.swap(maps);
+        }
+    }
+    catch (const std::exception &e)
+    {
+        m_err << e.what() << std::endl;
+        m_ret = -1;
+    }
+
+    if (m_opts.statsJson)
+        m_stats.writeJson(m_err);
+    return m_ret;
+}
+
+// open (or open again) every .iso and .log
+bool RescueCheck::open()
+{
+    if (m_isos.empty())
+    {
+        ImageList_t isos(m_isoNames.size());
+        ImageList_t logs(m_logNames.size());
+        m_isos.swap(isos);
+        m_logs.swap(logs);
+    }
+    for (size_t i = 0; i < m_isos.size(); i++)
+    {
+        if (!m_isos[i].open(m_isoNames[i], m_opts.ioPolicy))
+        {
+            m_err << "Failed to read " << m_isoNames[i] << std::endl;
+            return false;
+        }
+        const std::string &name = m_isoNames[i];
+        if ((name.size() >= 7) && (name.compare(name.size() - 7, 7, ".iso.gz") == 0) && !m_isos[i].compressed())
+        {   // such as a -gz image cut short, which lost its trailer
+            m_err << m_isoNames[i] << " is not an image written by -gz" << std::endl;
+            return false;
+        }
+        if (!m_logs[i].open(m_logNames[i], IO_READ))
+        {
+            m_err << "Failed to read " << m_logNames[i] << std::endl;
+            return false;
+        }
+        m_isos[i].countInto(&m_stats.io());
+        m_logs[i].countInto(&m_stats.io());
+    }
+    return true;
+}
+
+// the -x DIR.txt list of files
+void RescueCheck::readDir()
+{
+    if (m_opts.dirName.empty() || m_opts.useFilesystem)
+        return;
+    const std::string dirFileName = m_opts.dirName + ".txt";
+    ImageFile dirFile;
+    if (!dirFile.open(dirFileName))
+    {
+        std::ostringstream oss;
+        oss << "Failed to read " << dirFileName << std::endl;
+        throw std::runtime_error(oss.str());
+    }
+    std::vector<char> copy;
+    const char *text = reinterpret_cast<const char *>(dirFile.map(0, dirFile.size()));
+    if (!text && dirFile.size())
+    {
+        copy.resize(static_cast<size_t>(dirFile.size()));
+        if (!dirFile.read(0, &copy[0], dirFile.size()))
+            throw std::runtime_error(std::string("Failed to read ") + dirFileName);
+        text = &copy[0];
+    }
+    m_files.clear();
+    parseTriplets(text, text + dirFile.size(), m_opts.sectorSize, m_files);
+    sortFiles(m_files);
+}
+
+// the -fs list of files. It is read again each pass, as ddrescue may have rescued more directories.
+void RescueCheck::readFilesystem(const ExtentSet &f1Map, bool last)
+{
+    if (!m_opts.useFilesystem)
+        return;
+    RunStats::Timer timer(m_stats, PHASE_FILESYSTEM);
+    IsoFilesystem fs(m_out, m_isos[0], f1Map);
+    FileList_t files;
+    if (!fs.read(files))
+    {
+        if (last)
+            throw std::runtime_error(std::string("No ISO9660 volume descriptor rescued in ") + m_isoNames[0]);
+        return;
+    }
+    m_out << "Found " << std::dec << files.size() << " files in " << fs.directories() << " " <<
+        fs.kind() << " directories" << std::endl;
+    if (last)
+    {
+        for (size_t i = 0; i < fs.unreadable().size(); i++)
+            m_out << "Missing data for directory " << fs.unreadable()[i] << " can't list it." << std::endl;
+    }
+    sortFiles(files);
+    m_files.swap(files);
+    m_lostDirs = fs.unreadableExtents();
+}
+
+// parse every image's mapfile. true when ddrescue says it has finished all of them.
+bool RescueCheck::readLogs(std::vector<ExtentSet> &maps, std::vector<MapEntryList_t> &entries)
+{
+    AdrType_t total = 0;
+    for (size_t i = 0; i < m_logs.size(); i++)
+        total += m_logs[i].size();
+    RunStats::Timer timer(m_stats, PHASE_READ_LOG, total);
+    bool finished = true;
+    for (size_t i = 0; i < m_logs.size(); i++)
+    {
+        readLog(m_out, m_logs[i], m_isoNames[i], m_opts.statusChars, m_pool, maps[i], m_opts.useIndex ? &entries[i] : 0);
+        finished = finished && (mapfileStatus(m_logs[i]) == '+');
+        m_stats.advance(m_logs[i].size());
+    }
+    return finished;
+}
+
+// The holes in each image. A rescued range that is a hole reads as zeros, which is what an image
+// written with ddrescue --sparse has, but could also be an image that was copied badly.
+void RescueCheck::findHoles(const std::vector<ExtentSet> &maps)
+{
+    m_holes.assign(m_isos.size(), ExtentSet());
+    for (size_t i = 0; i < m_isos.size(); i++)
+    {
+        m_holes[i] = m_isos[i].holes();
+        const AdrType_t rescuedHoles = ExtentSet::intersect(maps[i], m_holes[i]).totalBytes();
+        if (rescuedHoles)
+            m_out << "Rescued bytes that are holes in " << m_isoNames[i] << " (read as zeros): " <<
+                std::dec << rescuedHoles << std::endl;
+    }
+}
+
+// the -c compare, or -merge. fresh, if given, limits the compare to those addresses.
+void RescueCheck::compare(const std::vector<ExtentSet> &maps, const std::vector<MapEntryList_t> &entries,
+    const ExtentSet *fresh)
+{
+    ImageList_t &isos = m_isos;
+
+    // Which images rescued which addresses. Where more than one did, the images get compared.
+    // Split those overlaps into work units for the pool.
+    CoverageList_t coverage;
+    CoverageList_t overlaps;
+    {
+        RunStats::Timer timer(m_stats, PHASE_COVERAGE);
+        coverage = findCoverage(maps);
+        size_t nextFresh = 0;
+        for (CoverageList_t::const_iterator itor = coverage.begin(); itor != coverage.end(); itor++)
+        {
+            if (countImages(itor->images) < 2)
+                continue;
+            if (!fresh)
+            {
+                overlaps.push_back(*itor);
+                continue;
+            }
+            const AdrType_t end = itor->pos + itor->len;
+            while ((nextFresh < fresh->size()) && ((*fresh)[nextFresh].pos + (*fresh)[nextFresh].len <= itor->pos))
+                nextFresh++;
+            for (size_t i = nextFresh; (i < fresh->size()) && ((*fresh)[i].pos < end); i++)
+            {
+                Coverage c = { std::max(itor->pos, (*fresh)[i].pos), 0, itor->images };
+                c.len = std::min(end, (*fresh)[i].pos + (*fresh)[i].len) - c.pos;
+                overlaps.push_back(c);
+            }
+        }
+    }
+    static const AdrType_t COMPARE_UNIT = 8 * BUFSIZE;
+    CoverageList_t compareUnits;
+    AdrType_t bytesCompared = 0;
+    AdrType_t bytesNotRead = 0;     // known to match without reading them
+    std::chrono::steady_clock::time_point compareStart = std::chrono::steady_clock::now();
+    for (CoverageList_t::const_iterator itor = overlaps.begin(); itor != overlaps.end(); itor++)
+    {
+        m_out << "Overlap starting 0x" << std::hex << itor->pos <<
+            " of length 0x" << std::hex << itor->len;
+        if (isos.size() > 2)
+            m_out << " in " << std::dec << countImages(itor->images) << " images";
+        m_out << std::endl;
+        AdrType_t end = itor->pos + itor->len;
+        for (AdrType_t begin = itor->pos; begin < end; begin += COMPARE_UNIT)
+        {
+            Coverage unit = { begin, std::min(end - begin, COMPARE_UNIT), itor->images };
+            compareUnits.push_back(unit);
+        }
+    }
+
+    // Where every image has a hole, the bytes are zeros in all of them. No need to read those.
+    bool anyHoles = false;
+    for (size_t i = 0; i < m_holes.size(); i++)
+        anyHoles = anyHoles || !m_holes[i].empty();
+    if (anyHoles && m_opts.mergeName.empty())
+    {
+        CoverageList_t withData;
+        AdrType_t bytesSkipped = 0;
+        for (CoverageList_t::const_iterator itor = compareUnits.begin(); itor != compareUnits.end(); itor++)
+        {
+            ExtentSet common;
+            bool firstImage = true;
+            for (unsigned i = 0; i < isos.size(); i++)
+            {
+                if (!(itor->images & (1u << i)))
+                    continue;
+                ExtentSet holes = m_holes[i].within(itor->pos, itor->len);
+                common = firstImage ? holes : ExtentSet::intersect(common, holes);
+                firstImage = false;
+            }
+            ExtentSet unit;
+            unit.append(itor->pos, itor->len);
+            const ExtentSet rest = ExtentSet::subtract(unit, common);
+            for (ExtentSet::const_iterator r = rest.begin(); r != rest.end(); r++)
+            {
+                Coverage c = { r->pos, r->len, itor->images };
+                withData.push_back(c);
+            }
+            bytesSkipped += common.totalBytes();
+        }
+        if (bytesSkipped)
+            m_out << "Bytes that are holes in every image: " << std::dec << bytesSkipped << std::endl;
+        compareUnits.swap(withData);
+        bytesNotRead += bytesSkipped;
+    }
+
+    // With -idx, bring each image's hash index up to date, reading only the blocks that
+    // changed status. Then only blocks whose hashes don't all agree need their bytes compared.
+    if (m_opts.useIndex && (isos.size() > 1) && m_opts.mergeName.empty())
+    {
+        RunStats::Timer timer(m_stats, PHASE_INDEX);
+        std::vector<HashIndex> indexes(isos.size());
+        for (size_t i = 0; i < isos.size(); i++)
+        {
+            indexes[i].load(m_idxNames[i], isos[i].size());
+            AdrType_t hashed = indexes[i].refresh(isos[i], entries[i], m_opts.statusChars, m_pool, BUFSIZE);
+            indexes[i].save(m_idxNames[i]);
+            m_out << "Hashed " << std::dec << hashed << " new blocks into " << m_idxNames[i] << std::endl;
+        }
+        CoverageList_t unhashed;
+        AdrType_t bytesSkipped = 0;
+        for (CoverageList_t::const_iterator itor = compareUnits.begin(); itor != compareUnits.end(); itor++)
+        {
+            const AdrType_t end = itor->pos + itor->len;
+            for (AdrType_t p = itor->pos; p < end; )
+            {
+                const AdrType_t block = p / CDROM_BLOCK_SIZE;
+                const AdrType_t n = std::min(end, (block + 1) * CDROM_BLOCK_SIZE) - p;
+                bool same = (n == CDROM_BLOCK_SIZE);
+                unsigned first = MAX_IMAGES;
+                for (unsigned i = 0; same && (i < isos.size()); i++)
+                {
+                    if (!(itor->images & (1u << i)))
+                        continue;
+                    if (!indexes[i].valid(block))
+                        same = false;
+                    else if (first == MAX_IMAGES)
+                        first = i;
+                    else if (indexes[i].hash(block) != indexes[first].hash(block))
+                        same = false;
+                }
+                if (same)
+                    bytesSkipped += n;
+                else if (!unhashed.empty() && (unhashed.back().pos + unhashed.back().len == p) &&
+                    (unhashed.back().images == itor->images) && (unhashed.back().len < COMPARE_UNIT))
+                    unhashed.back().len += n;
+                else
+                {
+                    Coverage c = { p, n, itor->images };
+                    unhashed.push_back(c);
+                }
+                p += n;
+            }
+        }
+        m_out << "Blocks matched by hash: " << std::dec << (bytesSkipped / CDROM_BLOCK_SIZE) << std::endl;
+        compareUnits.swap(unhashed);
+        bytesNotRead += bytesSkipped;
+    }
+
+    // Every sector that differs, when -diff asked for all of them. Otherwise the
+    // compare stops at the first mismatch. -merge reads the images itself and
+    // does the compare as it votes.
+    const bool fullScan = !m_opts.diffName.empty();
+    ExtentSet badBlocks;
+    if (!m_opts.cmpNames.empty())
+    {
+        AdrType_t total = 0;
+        const CoverageList_t &units = m_opts.mergeName.empty() ? compareUnits : coverage;
+        for (size_t i = 0; i < units.size(); i++)
+            total += units[i].len;
+        RunStats::Timer timer(m_stats, m_opts.mergeName.empty() ? PHASE_COMPARE : PHASE_MERGE, total);
+        if (!m_opts.mergeName.empty())
+            mergeImages(m_out, m_stats, isos, coverage, BUFSIZE, m_opts.sectorSize, m_opts.mergeName, badBlocks);
+        else if (compareUnits.empty())
+            ;
+        else if (m_opts.threadCount == 1)
+        {   // one thread: let the readers overlap the I/O of the next chunks with this compare
+            std::vector<ExtentList_t> perImage(isos.size());
+            for (CoverageList_t::const_iterator itor = compareUnits.begin(); itor != compareUnits.end(); itor++)
+                for (unsigned i = 0; i < isos.size(); i++)
+                    if (itor->images & (1u << i))
+                        perImage[i].push_back(Extent(itor->pos, itor->len));
+            std::vector<std::unique_ptr<ExtentReader> > readers;
+            for (unsigned i = 0; i < isos.size(); i++)
+                readers.push_back(std::unique_ptr<ExtentReader>(new ExtentReader(isos[i], perImage[i], BUFSIZE)));
+            const unsigned char *data[MAX_IMAGES];
+            for (CoverageList_t::const_iterator itor = compareUnits.begin(); itor != compareUnits.end(); itor++)
+            {
+                const AdrType_t end = itor->pos + itor->len;
+                for (AdrType_t pos = itor->pos; pos < end; pos += BUFSIZE)
+                {   // each reader cuts the unit into the same chunks
+                    unsigned count = 0;
+                    for (unsigned i = 0; i < isos.size(); i++)
+                    {
+                        if (!(itor->images & (1u << i)))
+                            continue;
+                        ExtentReader::Chunk c;
+                        if (!readers[i]->next(c) || !c.data)
+                            throw std::runtime_error( "oops cannot read " + m_isoNames[i]);
+                        data[count++] = c.data;
+                    }
+                    const AdrType_t len = std::min(BUFSIZE, end - pos);
+                    AdrType_t i = compareChunk(data, count, len, pos, fullScan ? &badBlocks : 0, m_opts.sectorSize);
+                    m_stats.advance(len);
+                    if (i != len)
+                    {
+                        std::ostringstream oss;
+                        oss << "Oops. Files do not match at 0x" << std::hex << (pos + i);
+                        throw std::runtime_error(oss.str());
+                    }
+                    bytesCompared += len;
+                }
+            }
+        }
+        else
+        {
+            AlignedBuffer workerBufs(static_cast<size_t>(isos.size() * BUFSIZE * m_pool.threads()));
+            // Units are in address order. Once a mismatch is known, units past it are skipped,
+            // but any unit before it still runs, so the lowest mismatch wins no matter the timing.
+            static const AdrType_t NO_MISMATCH = ~static_cast<AdrType_t>(0);
+            std::atomic<AdrType_t> firstBad(NO_MISMATCH);
+            std::vector<ExtentSet> unitBad(fullScan ? compareUnits.size() : 0);
+            m_pool.run(compareUnits.size(), [&](size_t i, unsigned worker)
+            {
+                const Coverage &unit = compareUnits[i];
+                if (unit.pos >= firstBad)
+                    return;
+                char *bufs = &workerBufs[isos.size() * BUFSIZE * worker];
+                AdrType_t end = unit.pos + unit.len;
+                AdrType_t mismatch = compareImages(isos, unit.images, unit.pos, end, bufs, BUFSIZE,
+                    fullScan ? &unitBad[i] : 0, m_opts.sectorSize);
+                m_stats.advance(unit.len);
+                if (mismatch == end)
+                    return;
+                AdrType_t prev = firstBad;
+                while ((mismatch < prev) && !firstBad.compare_exchange_weak(prev, mismatch))
+                    ;
+                // the units are in address order, so none after this one can have an earlier mismatch
+                m_pool.cancelFrom(i + 1);
+            });
+            if (firstBad != NO_MISMATCH)
+            {
+                std::ostringstream oss;
+                oss << "Oops. Files do not match at 0x" << std::hex << firstBad;
+                throw std::runtime_error(oss.str());
+            }
+            // a block that straddles two units shows up in both
+            for (size_t i = 0; i < unitBad.size(); i++)
+                for (ExtentSet::const_iterator itor = unitBad[i].begin(); itor != unitBad[i].end(); itor++)
+                    badBlocks.extend(itor->pos, itor->len);
+            for (size_t i = 0; i < compareUnits.size(); i++)
+                bytesCompared += compareUnits[i].len;
+        }
+    }
+    if (!m_opts.cmpNames.empty() && m_opts.mergeName.empty())
+    {
+        reportRate(m_out, "Compared", bytesCompared, compareStart);
+        if (bytesNotRead)
+            m_out << "Not read, as they match anyway: " << std::dec << bytesNotRead << " bytes" << std::endl;
+    }
+    if (fullScan)
+    {
+        // --follow keeps adding to the mismatches of the passes before
+        m_badBlocks = ExtentSet::unite(m_badBlocks, badBlocks);
+        AdrType_t badBytes = m_badBlocks.totalBytes();
+        AdrType_t size = 0;
+        for (size_t i = 0; i < isos.size(); i++)
+            size = std::max(size, isos[i].size());
+        m_out << "Mismatched blocks: " << std::dec << (badBytes / m_opts.sectorSize) <<
+            " (" << badBytes << " bytes in " << m_badBlocks.size() << " regions)" << std::endl;
+        writeMapfile(m_opts.diffName, m_badBlocks, '-', '+', size);
+        m_out << "Wrote mismatch mapfile " << m_opts.diffName << std::endl;
+        if (!m_badBlocks.empty())
+            m_ret = -1;
+    }
+}
+
+// process -x, for the files not already extracted. Files still missing data are
+// only reported on the last pass, or with -partial, written with holes then.
+void RescueCheck::extract(const ExtentSet &f1Map, bool last)
+{
+    // Decide first which files are wholly rescued. m_files is in address order, so those get
+    // extracted in the order they are in the iso, and the reads sweep across it once.
+    std::vector<const FileDesc *> toExtract;
+    std::vector<ExtentSet> parts;       // for a partly rescued file, the parts there are. Empty for a whole one.
+    for (size_t i = 0; i < m_files.size(); i++)
+    {
+        const FileDesc &file = m_files[i];
+        if (m_extracted.count(file.name))
+            continue;
+        if (f1Map.contains(file.pos, file.len))
+        {
+            toExtract.push_back(&file);
+            parts.push_back(ExtentSet());
+        }
+        else if (last)
+        {
+            ExtentSet rescued;
+            if (m_opts.partial)
+                rescued = f1Map.within(file.pos, file.len);
+            if (rescued.empty())
+                m_out << "Missing data for " << file.name << " can't extract." << std::endl;
+            else
+            {
+                toExtract.push_back(&file);
+                parts.push_back(rescued);
+            }
+        }
+    }
+    if (toExtract.empty())
+        return;
+
+    if (!m_createdDir)
+    {
+        if (!makeDirectory(m_opts.dirName))
+            throw std::runtime_error(std::string("Cannot create directory ") + m_opts.dirName);
+        m_createdDir = true;
+    }
+    // -fs names are full paths
+    std::set<std::string> subdirs;
+    for (size_t i = 0; i < toExtract.size(); i++)
+    {
+        const std::string &name = toExtract[i]->name;
+        for (std::string::size_type slash = name.find('/'); slash != name.npos; slash = name.find('/', slash + 1))
+        {
+            const std::string subdir = m_opts.dirName + "/" + name.substr(0, slash);
+            if (subdirs.insert(subdir).second && !makeDirectory(subdir))
+                throw std::runtime_error(std::string("Cannot create directory ") + subdir);
+        }
+    }
+
+    AdrType_t total = 0;
+    for (size_t i = 0; i < toExtract.size(); i++)
+        total += parts[i].empty() ? toExtract[i]->len : parts[i].totalBytes();
+    RunStats::Timer timer(m_stats, PHASE_EXTRACT, total);
+
+    // Each worker takes a run of files next to each other in the iso. The kernel copies them
+    // from the iso to the new files, or shares the blocks where the filesystem can.
+    std::chrono::steady_clock::time_point extractStart = std::chrono::steady_clock::now();
+    AlignedBuffer workerBufs(static_cast<size_t>(BUFSIZE) * m_pool.threads());
+    std::vector<AdrType_t> workerReflinked(m_pool.threads());
+    ImageFile &f1Iso = m_isos[0];
+    m_pool.run(toExtract.size(), [&](size_t i, unsigned worker)
+    {
+        const FileDesc &file = *toExtract[i];
+        const std::string outName = m_opts.dirName + "/" + file.name;
+        ImageWriter out;
+        if (!out.open(outName))
+            throw std::runtime_error(std::string("Cannot create ") + file.name );
+        AdrType_t reflinked = 0;
+        char *buf = &workerBufs[static_cast<size_t>(BUFSIZE) * worker];
+        const ExtentSet &rescued = parts[i];
+        if (rescued.empty())
+        {
+            if (!out.copyFrom(f1Iso, file.pos, 0, file.len, buf, BUFSIZE, reflinked))
+                throw std::runtime_error(std::string("Oops failed to read ") + file.name);
+            workerReflinked[worker] += reflinked;
+            m_stats.advance(file.len);
+            return;
+        }
+        // Only the rescued parts are written. The file is sized first, so the gaps between them
+        // are holes, and are punched as well in case the filesystem allocated them anyway.
+        if (!out.setSize(file.len))
+            throw std::runtime_error(std::string("Cannot write ") + file.name);
+        ExtentSet bad;
+        AdrType_t filePos = 0;
+        for (ExtentSet::const_iterator itor = rescued.begin(); itor != rescued.end(); itor++)
+        {
+            const AdrType_t destPos = itor->pos - file.pos;
+            if (!out.copyFrom(f1Iso, itor->pos, destPos, itor->len, buf, BUFSIZE, reflinked))
+                throw std::runtime_error(std::string("Oops failed to read ") + file.name);
+            workerReflinked[worker] += reflinked;
+            m_stats.advance(itor->len);
+            if (destPos > filePos)
+                bad.append(filePos, destPos - filePos);
+            filePos = destPos + itor->len;
+        }
+        if (file.len > filePos)
+            bad.append(filePos, file.len - filePos);
+        for (ExtentSet::const_iterator itor = bad.begin(); itor != bad.end(); itor++)
+            out.punchHole(itor->pos, itor->len);
+        writeMapfile(outName + ".log", bad, '-', '+', file.len);
+    });
+
+    AdrType_t bytesExtracted = 0;
+    AdrType_t bytesReflinked = 0;
+    for (size_t i = 0; i < toExtract.size(); i++)
+    {
+        const FileDesc &file = *toExtract[i];
+        if (parts[i].empty())
+        {
+            m_out << "Extracted file " << file.name << std::endl;
+            bytesExtracted += file.len;
+        }
+        else
+        {
+            const AdrType_t rescued = parts[i].totalBytes();
+            m_out << "Extracted part of file " << file.name << ", " << std::dec << rescued << " of " <<
+                file.len << " bytes. Its gaps are in " << file.name << ".log" << std::endl;
+            bytesExtracted += rescued;
+        }
+        m_extracted.insert(file.name);
+    }
+    for (size_t i = 0; i < workerReflinked.size(); i++)
+        bytesReflinked += workerReflinked[i];
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - extractStart).count();
+    m_out << "Extracted " << std::dec << toExtract.size() << " files, " << bytesExtracted << " bytes in " <<
+        seconds << " seconds";
+    if (seconds > 0)
+        m_out << " (" << (toExtract.size() / seconds) << " files/s, " << (bytesExtracted / seconds / 1e6) << " MB/s)";
+    if (bytesReflinked)
+        m_out << ", " << bytesReflinked << " bytes reflinked";
+    m_out << std::endl;
+}
+
+// process -domain: the blocks of the -x files ddrescue hasn't rescued yet, as a domain mapfile
+// for ddrescue -m, so its next run reads only those. Each file is reported with how much of it
+// has been rescued, the nearest to complete first.
+void RescueCheck::writeDomain(const ExtentSet &f1Map, bool last)
+{
+    if (m_opts.domainName.empty())
+        return;
+    struct Wanted
+    {
+        const FileDesc *file;
+        AdrType_t blocksLen;    // the file's length, to the end of its last sector
+        AdrType_t missing;
+    };
+    std::vector<Wanted> wanted;
+    wanted.reserve(m_files.size());
+    for (size_t i = 0; i < m_files.size(); i++)
+    {
+        const AdrType_t sector = m_opts.sectorSize;
+        const AdrType_t len = (m_files[i].len + sector - 1) / sector * sector;
+        Wanted w = { &m_files[i], len, 0 };
+        wanted.push_back(w);
+    }
+
+    // One merge-join of the files (m_files is in address order) against the rescued extents. A file
+    // never starts before the one ahead of it, so the extent it starts looking from only moves on.
+    ExtentList_t gaps(m_lostDirs);
+    ExtentSet::const_iterator from = f1Map.begin();
+    for (size_t i = 0; i < wanted.size(); i++)
+    {
+        const AdrType_t begin = wanted[i].file->pos;
+        const AdrType_t end = begin + wanted[i].blocksLen;
+        while ((from != f1Map.end()) && (from->pos + from->len <= begin))
+            ++from;
+        AdrType_t pos = begin;
+        for (ExtentSet::const_iterator itor = from; (itor != f1Map.end()) && (itor->pos < end) && (pos < end); ++itor)
+        {
+            if (itor->pos > pos)
+            {
+                gaps.push_back(Extent(pos, itor->pos - pos));
+                wanted[i].missing += itor->pos - pos;
+            }
+            pos = std::max(pos, std::min(end, itor->pos + itor->len));
+        }
+        if (pos < end)
+        {
+            gaps.push_back(Extent(pos, end - pos));
+            wanted[i].missing += end - pos;
+        }
+    }
+    // files can share blocks, so the gaps can overlap
+    std::sort(gaps.begin(), gaps.end(), [](const Extent &a, const Extent &b) { return a.pos < b.pos; });
+    ExtentSet domain;
+    for (size_t i = 0; i < gaps.size(); i++)
+        domain.extend(gaps[i].pos, gaps[i].len);
+    // ddrescue wants the mapfile in address order, so the order by completeness is only in the report
+    writeMapfile(m_opts.domainName, domain, '+', '?', m_isos[0].size());
+
+    std::vector<size_t> incomplete;
+    for (size_t i = 0; i < wanted.size(); i++)
+        if (wanted[i].missing)
+            incomplete.push_back(i);
+    std::stable_sort(incomplete.begin(), incomplete.end(), [&](size_t a, size_t b)
+        { return double(wanted[a].missing) / wanted[a].blocksLen < double(wanted[b].missing) / wanted[b].blocksLen; });
+    if (last)
+    {
+        for (size_t i = 0; i < incomplete.size(); i++)
+        {
+            const Wanted &w = wanted[incomplete[i]];
+            // rounded down, so a file missing anything is never 100%
+            std::ostringstream percent;
+            percent << std::fixed << std::setprecision(1) << std::setw(5) <<
+                (std::floor(1000.0 * (w.blocksLen - w.missing) / w.blocksLen) / 10);
+            m_out << percent.str() << "% of " << w.file->name << " rescued, " << std::dec <<
+                w.missing << " bytes to go" << std::endl;
+        }
+    }
+    m_out << "Wrote domain mapfile " << m_opts.domainName << ": " << std::dec << domain.totalBytes() <<
+        " bytes in " << domain.size() << " regions for " << incomplete.size() << " of " << wanted.size() <<
+        " files";
+    if (!m_lostDirs.empty())
+        m_out << " and " << m_lostDirs.size() << " directories";
+    m_out << std::endl;
+}
+
+// process -jpeg
+// scan the iso for jpeg files
+void RescueCheck::scanJpeg(const ExtentSet &f1Map)
+{
+    if (m_opts.jpgTextName.empty())
+        return;
+    RunStats::Timer timer(m_stats, PHASE_JPEG);
+    std::chrono::steady_clock::time_point scanStart = std::chrono::steady_clock::now();
+    std::vector<CarveHitList_t> hits;
+    AdrType_t bytesScanned = scanExtents(f1Map, m_jpgScans,
+        sectorKernel(m_opts.sectorSize, SECTOR_KERNELS(scanJpegChunk)), hits);
+    writeHits(m_opts.jpgTextName, m_jpg, hits);
+    reportRate(m_out, "Scanned", bytesScanned, scanStart);
+}
+
+// process -carve
+// scan the iso for the starts of every kind of file in CARVE_RULES, all in the one pass
+void RescueCheck::carve(const ExtentSet &f1Map)
+{
+    if (m_opts.carveTextName.empty())
+        return;
+    RunStats::Timer timer(m_stats, PHASE_CARVE);
+    std::chrono::steady_clock::time_point carveStart = std::chrono::steady_clock::now();
+    std::vector<CarveHitList_t> hits;
+    AdrType_t bytesScanned = scanExtents(f1Map, m_carveScans,
+        sectorKernel(m_opts.sectorSize, SECTOR_KERNELS(scanCarveChunk)), hits);
+    writeHits(m_opts.carveTextName, m_carve, hits);
+    reportRate(m_out, "Carved", bytesScanned, carveStart);
+}
+
+// -gz: <f1>.iso as gzName.iso.gz, without the frames ddrescue hasn't read anything of, and its mapfile as gzName.log
+void RescueCheck::compress()
+{
+    if (m_opts.gzName.empty())
+        return;
+    RunStats::Timer timer(m_stats, PHASE_COMPRESS);
+    // gzName.log is a copy of the whole mapfile, so every range it gives a status other than '?'
+    // is stored, whatever --status picked. Ranges that are holes in the .iso read as zeros anyway.
+    ExtentSet tried;
+    std::ostringstream quiet;
+    readLog(quiet, m_logs[0], m_isoNames[0], "*/-+", m_pool, tried);
+    writeCompressed(m_out, m_stats, m_pool, m_isos[0], ExtentSet::subtract(tried, m_holes[0]),
+        m_opts.gzName + ".iso.gz");
+    const std::string logName = m_opts.gzName + ".log";
+    std::vector<char> text(static_cast<size_t>(m_logs[0].size()) + 1);
+    std::ofstream ofs(logName.c_str(), std::ofstream::binary | std::ofstream::trunc);
+    if (!m_logs[0].read(0, &text[0], m_logs[0].size()) || !ofs.write(&text[0], m_logs[0].size()))
+        throw std::runtime_error(std::string("Failed to write ") + logName);
+    m_out << "Wrote " << m_opts.gzName << ".iso.gz and " << logName << std::endl;
+}
+
+// process -edc
+// check the EDC, and for -ecc the P and Q parity, of each rescued raw sector
+void RescueCheck::verifyEdc(const ExtentSet &f1Map)
+{
+    if (m_opts.edcName.empty())
+        return;
+    RunStats::Timer timer(m_stats, PHASE_EDC);
+    std::chrono::steady_clock::time_point verifyStart = std::chrono::steady_clock::now();
+    // A sector at the end of an extent that is only partly rescued waits for the rest of it.
+    // Sectors need nothing from the ones before, so a big extent is checked in pieces that -j
+    // can share out. The pieces are counted from the extent's start, so those of an extent
+    // that --follow finds grown are the ones it had, and more.
+    const AdrType_t sector = RAW_SECTOR_SIZE;
+    const AdrType_t piece = BUFSIZE / sector * sector * 16;
+    ExtentSet whole;
+    for (ExtentSet::const_iterator itor = f1Map.begin(); itor != f1Map.end(); itor++)
+    {
+        const AdrType_t first = (itor->pos + sector - 1) / sector * sector;
+        const AdrType_t last = (itor->pos + itor->len) / sector * sector;
+        for (AdrType_t pos = first; pos < last; pos += piece)
+            whole.append(pos, std::min(piece, last - pos));
+    }
+    std::vector<RawSectorCheck> checks;
+    AdrType_t bytesVerified = scanExtents(whole, m_edcScans,
+        m_opts.checkEcc ? &verifyRawSectors<true> : &verifyRawSectors<false>, checks);
+    for (size_t i = 0; i < checks.size(); i++)
+    {
+        m_edc.mode1 += checks[i].mode1;
+        m_edc.form1 += checks[i].form1;
+        m_edc.form2 += checks[i].form2;
+        m_edc.unchecked += checks[i].unchecked;
+        m_edc.bad = ExtentSet::unite(m_edc.bad, checks[i].bad);
+    }
+    reportRate(m_out, "Verified", bytesVerified, verifyStart);
+
+    const AdrType_t badBytes = m_edc.bad.totalBytes();
+    m_out << "Raw sectors that check out: " << std::dec << m_edc.mode1 << " Mode 1, " <<
+        m_edc.form1 << " Mode 2 Form 1, " << m_edc.form2 << " Mode 2 Form 2" << std::endl;
+    if (m_edc.unchecked)
+        m_out << "Raw sectors with no EDC to check: " << m_edc.unchecked << std::endl;
+    m_out << "Raw sectors that fail " << (m_opts.checkEcc ? "EDC or ECC: " : "EDC: ") <<
+        (badBytes / sector) << " (" << badBytes << " bytes in " << m_edc.bad.size() << " regions)" << std::endl;
+    writeMapfile(m_opts.edcName, m_edc.bad, '-', '+', m_isos[0].size());
+    m_out << "Wrote EDC mapfile " << m_opts.edcName << std::endl;
+    if (!m_edc.bad.empty())
+        m_ret = -1;
+}
+
+/* Run scanChunk over each extent of f1Map, a chunk at a time. Each extent starts its scan over,
+** so extents can be scanned at the same time. An extent an earlier pass scanned to its end is
+** scanned only from there. Returns the number of bytes scanned. */
+template <typename Scan, typename Hits, typename ScanChunk>
+AdrType_t RescueCheck::scanExtents(const ExtentSet &f1Map, std::map<AdrType_t, Scan> &scans, ScanChunk scanChunk,
+    std::vector<Hits> &hits)
+{
+    std::map<AdrType_t, Scan> next;
+    ExtentList_t ranges;
+    std::vector<Scan *> rangeScans;
+    AdrType_t bytesScanned = 0;
+    for (ExtentSet::const_iterator itor = f1Map.begin(); itor != f1Map.end(); itor++)
+    {
+        const AdrType_t f1Last = itor->pos + itor->len;
+        Scan &scan = next[itor->pos];
+        typename std::map<AdrType_t, Scan>::const_iterator prev = scans.find(itor->pos);
+        if ((prev != scans.end()) && (prev->second.pos <= f1Last) &&
+            ((prev->second.pos - itor->pos) % m_opts.sectorSize == 0))
+            scan = prev->second;
+        else
+            scan.pos = itor->pos;
+        if (scan.pos < f1Last)
+        {
+            ranges.push_back(Extent(scan.pos, f1Last - scan.pos));
+            rangeScans.push_back(&scan);
+            bytesScanned += f1Last - scan.pos;
+        }
+    }
+
+    m_stats.expect(bytesScanned);
+    hits.assign(ranges.size(), Hits());
+    ImageFile &f1Iso = m_isos[0];
+    // whole sectors per chunk, so only the last chunk of an extent can end inside one
+    const AdrType_t chunkSize = BUFSIZE / m_opts.sectorSize * m_opts.sectorSize;
+    if (m_pool.threads() == 1)
+    {   // one thread: let the reader overlap the I/O of the next chunks with this scan
+        ExtentReader reader(f1Iso, ranges, chunkSize);
+        ExtentReader::Chunk chunk;
+        while (reader.next(chunk))
+        {
+            if (!chunk.data)
+            {
+                std::ostringstream oss;
+                oss << "Failed to read bytes from " << m_isoNames[0] << " at " <<
+                    std::hex << chunk.pos << " length " << std::hex << chunk.len;
+                throw std::runtime_error(oss.str());
+            }
+            scanChunk(chunk.data, chunk.pos, chunk.len, *rangeScans[chunk.extent], hits[chunk.extent],
+                m_opts.sectorSize);
+            m_stats.advance(chunk.len);
+        }
+    }
+    else
+    {
+        AlignedBuffer workerBufs(static_cast<size_t>(BUFSIZE) * m_pool.threads());
+        m_pool.run(ranges.size(), [&](size_t i, unsigned worker)
+        {
+            const AdrType_t f1Last = ranges[i].pos + ranges[i].len;
+            for (AdrType_t pos = ranges[i].pos; pos < f1Last; pos += chunkSize)
+            {
+                const AdrType_t len = std::min(f1Last - pos, chunkSize);
+                const unsigned char *data = f1Iso.map(pos, len);
+                if (!data)
+                {
+                    char *buf = &workerBufs[static_cast<size_t>(BUFSIZE) * worker];
+                    if (!f1Iso.read(pos, buf, len))
+                    {
+                        std::ostringstream oss;
+                        oss << "Failed to read bytes from " << m_isoNames[0] << " at " <<
+                            std::hex << pos << " length " << std::hex << len;
+                        throw std::runtime_error(oss.str());
+                    }
+                    data = reinterpret_cast<const unsigned char *>(buf);
+                }
+                scanChunk(data, pos, len, *rangeScans[i], hits[i], m_opts.sectorSize);
+                m_stats.advance(len);
+            }
+        });
+    }
+    scans.swap(next);
+    return bytesScanned;
+}
+
+// number the files found and write their triplets to the file name, in address order.
+// A --follow pass may find a header again that an earlier pass already numbered.
+void RescueCheck::writeHits(const std::string &name, CarveOutput &out, const std::vector<CarveHitList_t> &hits)
+{
+    if (!out.text.is_open())
+    {
+        out.text.open(name.c_str());
+        if (!out.text.is_open())
+            throw std::runtime_error(std::string("Could not open ") + name);
+    }
+    for (size_t i = 0; i < hits.size(); i++)
+    {
+        for (CarveHitList_t::const_iterator hit = hits[i].begin(); hit != hits[i].end(); hit++)
+        {
+            if (hit->kind == CarveHit::MISALIGNED)
+            {
+                std::ostringstream oss;
+                oss << "oops: ddrescue block not on CDROM block size boundary: "
+                    << std::hex << hit->block;
+                throw std::runtime_error(oss.str());
+            }
+            const CarveRule &rule = CARVE_RULES[hit->rule];
+            int &number = out.numbers[static_cast<long>(hit->block)];
+            if (hit->kind == CarveHit::HEADER)
+            {
+                if (!number)
+                {
+                    number = ++out.count;
+                    m_out << rule.name << " header at block number " << std::hex << hit->block << std::endl;
+                }
+            }
+            else if (out.written.insert(static_cast<long>(hit->block)).second)
+                out.text << "] " << std::hex << hit->block << " " << std::dec <<
+                    hit->length << " 00/ File" <<
+                    number << "." << rule.ext << ";1" << std::endl;
+        }
+    }
+    out.text.flush();
+}
+
+/* Run the jpeg state machine over the len bytes at pos, carrying on from scan.
+** Only whole sectors are scanned: a file can only start at the beginning of one.
+** Inside a file, memchr finds the next 0xFF marker, and a marker segment's length
+** field says how much to jump over, rather than going a byte at a time. */
+template <unsigned N>
+static void scanJpegChunk(const unsigned char *data, AdrType_t pos, AdrType_t len, JpegScan &scan,
+    CarveHitList_t &hits, AdrType_t sectorSize)
+{
+    const AdrType_t sector = kernelSectorSize<N>(sectorSize);
+    JpegState_t jpgfileInProgress = scan.state;
+    long jpgFileLength = scan.fileLength;
+    long jpgFileBlockNum = scan.fileBlockNum;
+    int skipping = scan.skipping;
+    scan.pos = pos + len;
+
+    const AdrType_t numBlocks = len / sector;
+    for (AdrType_t i = 0; i < numBlocks; i++)
+    {
+        const unsigned char *block = &data[i * sector];
+        const unsigned char *blockEnd = block + sector;
+        const unsigned char *p = block;
+        while (p < blockEnd)
+        {
+            switch (jpgfileInProgress)
+            {
+            case NO_FILE:
+                if ((block[0] == 0xFF) && (block[1] == 0xD8) && (block[2] == 0xFF) && (block[3] == 0xE0) &&
+                    (strcmp((const char *)&block[6], "JFIF") == 0))
+                {
+                    if (pos % sector)
+                    {
+                        CarveHit hit = { CarveHit::MISALIGNED, 0, pos, 0 };
+                        hits.push_back(hit);
+                        return;
+                    }
+                    int blockSize = (block[5] & 0xFF) | ((block[4] << 8) & 0xFF00);
+                    // reset our pointer to end of this block
+                    p = &block[blockSize + 4];
+                    jpgFileBlockNum = static_cast<long>(pos / sector + i);
+                    jpgFileLength = 0;
+                    jpgfileInProgress = IN_PROGRESS;
+                    CarveHit hit = { CarveHit::HEADER, 0, static_cast<AdrType_t>(jpgFileBlockNum), 0 };
+                    hits.push_back(hit);
+                }
+                else
+                    p = blockEnd;
+                break;
+
+            case IN_PROGRESS:
+                p = static_cast<const unsigned char *>(memchr(p, 0xFF, blockEnd - p));
+                if (!p)
+                    p = blockEnd;
+                else
+                {
+                    p++;
+                    jpgfileInProgress = FOUND_0XFF;
+                }
+                break;
+
+            case FOUND_0XFF:
+                {
+                    unsigned char c = *p++;
+                    if (c == 0xD9)
+                        jpgfileInProgress = COMPLETE;
+                    else if (c == 0xFF); // do nothing
+                    else if (c == 0)
+                        jpgfileInProgress = IN_PROGRESS;
+                    // http://en.wikipedia.org/wiki/JPEG
+                    // http://www.fileformat.info/format/jpeg/egff.htm
+                    else if (((c & 0xF0) == 0xd0) &&
+                          ((c & 0x0F) <= 7))
+                    {
+                        jpgfileInProgress = IN_PROGRESS;
+                    }
+                    else
+                    {
+                        unsigned char top4 = c & 0xF0;
+                        if ((top4 == 0xC0) ||
+                            (top4 == 0xD0) ||
+                            (top4 == 0xE0) ||
+                            (top4 == 0xF0))
+                        {
+                            jpgfileInProgress = FOUND_BC0;
+                            skipping = 0;
+                        }
+                        else
+                        {
+                            jpgfileInProgress = IN_PROGRESS;
+                        }
+                    }
+                }
+                break;
+
+            case FOUND_BC0:
+                skipping += *p++;
+                jpgfileInProgress = FOUND_BC1;
+                break;
+
+            case FOUND_BC1:
+                skipping <<= 8;
+                skipping |= *p++;
+                skipping -= 2;
+                if (skipping > 0)
+                    jpgfileInProgress = SKIPPING;
+                else
+                    jpgfileInProgress = IN_PROGRESS; // tests don't get here
+                break;
+
+            case SKIPPING:
+                {   // the rest of the segment, or as much of it as this block holds
+                    int n = static_cast<int>(std::min<AdrType_t>(skipping, blockEnd - p));
+                    p += n;
+                    skipping -= n;
+                    if (skipping <= 0)
+                        jpgfileInProgress = IN_PROGRESS;
+                }
+                break;
+
+            case COMPLETE:
+                break;
+            }
+            if (jpgfileInProgress == COMPLETE)
+            {
+                jpgfileInProgress = NO_FILE;
+                jpgFileLength += static_cast<int>(p - block);
+                CarveHit hit = { CarveHit::FILE_END, 0, static_cast<AdrType_t>(jpgFileBlockNum),
+                    static_cast<AdrType_t>(jpgFileLength) };
+                hits.push_back(hit);
+                break;  // file can only start on block boundary
+            }
+        }
+        jpgFileLength += static_cast<long>(sector);
+    }
+    scan.state = jpgfileInProgress;
+    scan.fileLength = jpgFileLength;
+    scan.fileBlockNum = jpgFileBlockNum;
+    scan.skipping = skipping;
+}
+
+// CARVE_RULES by the first byte of their magic
+struct CarveIndex
+{
+    CarveIndex()
+    {
+        for (size_t i = 0; i < CARVE_RULE_COUNT; i++)
+            byFirstByte[static_cast<unsigned char>(CARVE_RULES[i].magic[0])].push_back(static_cast<unsigned char>(i));
+    }
+    std::vector<unsigned char> byFirstByte[256];
+};
+
+// the bytes a block must have for the rules to look at its header
+static const AdrType_t CARVE_HEADER_BYTES = 16;
+
+// which rule's file starts at p, or -1
+static int matchCarveRule(const unsigned char *p)
+{
+    static const CarveIndex index;
+    const std::vector<unsigned char> &candidates = index.byFirstByte[p[0]];
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+        const CarveRule &rule = CARVE_RULES[candidates[i]];
+        if (memcmp(p, rule.magic, rule.magicLen) ||
+            (rule.tagLen && memcmp(p + rule.tagOffset, rule.tag, rule.tagLen)))
+            continue;
+        // a RIFF size too big to believe is not a file
+        if ((rule.end == END_SIZE_FIELD) &&
+            (p[4] + (p[5] << 8) + (p[6] << 16) + (static_cast<AdrType_t>(p[7]) << 24) + 8 > rule.maxLen))
+            continue;
+        return candidates[i];
+    }
+    return -1;
+}
+
+// start on the file whose header is at p, at address pos
+static void startCarve(CarveScan &scan, int rule, const unsigned char *p, AdrType_t pos)
+{
+    scan.rule = rule;
+    scan.fileStart = pos;
+    scan.state = 0;
+    scan.heldLen = 0;
+    scan.footerMatched = 0;
+    switch (CARVE_RULES[rule].end)
+    {
+    case END_SIZE_FIELD:
+        scan.skip = p[4] + (p[5] << 8) + (p[6] << 16) + (static_cast<AdrType_t>(p[7]) << 24) + 8;
+        break;
+    case END_MP3:   // the ID3 tag's size is in 7 bit bytes and leaves out its 10 byte header
+        scan.skip = 10 + (((p[6] & 0x7F) << 21) | ((p[7] & 0x7F) << 14) | ((p[8] & 0x7F) << 7) | (p[9] & 0x7F));
+        break;
+    case END_JPEG:  // just SOI. The segments after it get walked.
+        scan.skip = 2;
+        break;
+    default:
+        scan.skip = CARVE_RULES[rule].magicLen;
+        break;
+    }
+}
+
+// gather n bytes of a field into scan.held. false if the chunk ran out first.
+static bool gatherField(CarveScan &scan, const unsigned char *&p, const unsigned char *end, unsigned n)
+{
+    while ((scan.heldLen < n) && (p < end))
+        scan.held[scan.heldLen++] = *p++;
+    return scan.heldLen == n;
+}
+
+// how far a footer is matched once c follows the matched bytes of it
+static unsigned matchFooter(const char *footer, unsigned len, unsigned matched, unsigned char c)
+{
+    for (;;)
+    {
+        if ((matched < len) && (static_cast<unsigned char>(footer[matched]) == c))
+            return matched + 1;
+        if (!matched)
+            return 0;
+        // fall back to the longest start of the footer that the bytes matched end with
+        unsigned k = matched - 1;
+        while (k && memcmp(footer, footer + matched - k, k))
+            k--;
+        matched = k;
+    }
+}
+
+// the length of the MPEG audio frame whose 4 byte header is h, or 0 if h isn't one
+static AdrType_t mpegFrameLength(const unsigned char *h)
+{
+    static const unsigned short BITRATES[5][15] =
+    {   // kbit/s: MPEG 1 layers I, II, III, then MPEG 2 and 2.5 layer I, then layers II and III
+        {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+    };
+    static const unsigned SAMPLE_RATES[3] = {44100, 48000, 32000};
+    if ((h[0] != 0xFF) || ((h[1] & 0xE0) != 0xE0))
+        return 0;
+    const unsigned version = (h[1] >> 3) & 3;   // 0 is 2.5, 2 is 2, 3 is 1
+    const unsigned layer = 4 - ((h[1] >> 1) & 3);
+    const unsigned bitrateIdx = h[2] >> 4;
+    const unsigned rateIdx = (h[2] >> 2) & 3;
+    const unsigned padding = (h[2] >> 1) & 1;
+    if ((version == 1) || (layer == 4) || (bitrateIdx == 0) || (bitrateIdx == 15) || (rateIdx == 3))
+        return 0;
+    const unsigned table = (version == 3) ? layer - 1 : ((layer == 1) ? 3 : 4);
+    const unsigned bitrate = BITRATES[table][bitrateIdx] * 1000;
+    const unsigned rate = SAMPLE_RATES[rateIdx] >> ((version == 3) ? 0 : ((version == 2) ? 1 : 2));
+    if (layer == 1)
+        return (12 * bitrate / rate + padding) * 4;
+    if ((layer == 3) && (version != 3))
+        return 72 * bitrate / rate + padding;
+    return 144 * bitrate / rate + padding;
+}
+
+enum CarveStep_t {CARVE_MORE, CARVE_DONE, CARVE_ABANDON};
+
+/* Feed the file in progress the bytes from p on. CARVE_MORE when it has used them all and needs
+** the next chunk. On CARVE_DONE the file ended at p, less any bytes still held. */
+static CarveStep_t stepCarve(CarveScan &scan, const unsigned char *&p, const unsigned char *end)
+{
+    const CarveRule &rule = CARVE_RULES[scan.rule];
+    for (;;)
+    {
+        if (scan.skip)
+        {
+            const AdrType_t n = std::min<AdrType_t>(scan.skip, end - p);
+            p += n;
+            scan.skip -= n;
+            if (scan.skip)
+                return CARVE_MORE;
+        }
+        switch (rule.end)
+        {
+        case END_SIZE_FIELD:
+            return CARVE_DONE;
+
+        case END_JPEG:
+            if (scan.state == 0)
+            {   // in entropy coded data, or between segments: only a marker matters
+                if (p == end)
+                    return CARVE_MORE;
+                const unsigned char *ff = static_cast<const unsigned char *>(memchr(p, 0xFF, end - p));
+                if (!ff)
+                {
+                    p = end;
+                    return CARVE_MORE;
+                }
+                p = ff + 1;
+                scan.state = 1;
+            }
+            else if (scan.state == 1)
+            {
+                if (p == end)
+                    return CARVE_MORE;
+                unsigned char c = *p++;
+                if (c == 0xD9)
+                    return CARVE_DONE;
+                else if (c == 0xFF)
+                    ;   // fill byte
+                else if ((c < 0xC0) || (c == 0xD8) || ((c & 0xF8) == 0xD0))
+                    scan.state = 0;     // a stuffed zero, or a marker with no segment
+                else
+                    scan.state = 2;
+            }
+            else
+            {   // the segment's length counts its own two bytes
+                if (!gatherField(scan, p, end, 2))
+                    return CARVE_MORE;
+                scan.heldLen = 0;
+                scan.skip = (scan.held[0] << 8) | scan.held[1];
+                if (scan.skip < 2)
+                    return CARVE_ABANDON;
+                scan.skip -= 2;
+                scan.state = 0;
+            }
+            break;
+
+        case END_PNG:
+            if (scan.state == 1)
+                return CARVE_DONE;  // past IEND's CRC
+            if (!gatherField(scan, p, end, 8))
+                return CARVE_MORE;
+            scan.heldLen = 0;
+            {   // length and type, then the data and a CRC
+                const AdrType_t len = (static_cast<AdrType_t>(scan.held[0]) << 24) | (scan.held[1] << 16) |
+                    (scan.held[2] << 8) | scan.held[3];
+                for (unsigned i = 4; i < 8; i++)
+                    if (!isalpha(scan.held[i]))
+                        return CARVE_ABANDON;
+                if (len & 0x80000000)
+                    return CARVE_ABANDON;
+                scan.skip = len + 4;
+                if (!memcmp(&scan.held[4], "IEND", 4))
+                    scan.state = 1;
+            }
+            break;
+
+        case END_FOOTER:
+        case END_ZIP:
+            if (scan.state == 0)
+            {
+                if (p == end)
+                    return CARVE_MORE;
+                if (!scan.footerMatched)
+                {
+                    const unsigned char *f = static_cast<const unsigned char *>(memchr(p, rule.footer[0], end - p));
+                    if (!f)
+                    {
+                        p = end;
+                        return CARVE_MORE;
+                    }
+                    p = f;
+                }
+                scan.footerMatched = matchFooter(rule.footer, rule.footerLen, scan.footerMatched, *p++);
+                if (scan.footerMatched == rule.footerLen)
+                {
+                    scan.footerMatched = 0;
+                    if (rule.end == END_FOOTER)
+                        return CARVE_DONE;
+                    // the end of central directory record: 16 more bytes, then the comment's length
+                    scan.skip = 16;
+                    scan.state = 1;
+                }
+            }
+            else if (scan.state == 1)
+            {
+                if (!gatherField(scan, p, end, 2))
+                    return CARVE_MORE;
+                scan.heldLen = 0;
+                scan.skip = scan.held[0] | (scan.held[1] << 8);
+                scan.state = 2;
+            }
+            else
+                return CARVE_DONE;
+            break;
+
+        case END_MP3:
+            if (scan.state == 2)
+                return CARVE_DONE;  // past an ID3v1 tag
+            if (!gatherField(scan, p, end, 4))
+                return CARVE_MORE;
+            if (!memcmp(scan.held, "TAG", 3))
+            {   // an ID3v1 tag is 128 bytes at the very end
+                scan.heldLen = 0;
+                scan.skip = 128 - 4;
+                scan.state = 2;
+            }
+            else
+            {
+                const AdrType_t frame = mpegFrameLength(scan.held);
+                if (!frame)     // what was held is past the end of the file
+                    return (scan.state == 1) ? CARVE_DONE : CARVE_ABANDON;
+                scan.heldLen = 0;
+                scan.skip = frame - 4;
+                scan.state = 1;
+            }
+            break;
+        }
+    }
+}
+
+/* Look for every kind of file in CARVE_RULES in the len bytes at pos, carrying on from scan.
+** A file can only start at the beginning of a sector. Between files, one look at the first
+** byte of each sector picks the few rules that could match it. */
+template <unsigned N>
+static void scanCarveChunk(const unsigned char *data, AdrType_t pos, AdrType_t len, CarveScan &scan,
+    CarveHitList_t &hits, AdrType_t sectorSize)
+{
+    const AdrType_t sector = kernelSectorSize<N>(sectorSize);
+    const unsigned char *p = data;
+    const unsigned char *end = data + len;
+    scan.pos = pos + len;
+    for (;;)
+    {
+        if (scan.rule < 0)
+        {   // to the start of the next sector
+            const AdrType_t at = pos + (p - data);
+            const AdrType_t offset = (at + sector - 1) / sector * sector - pos;
+            if (offset + CARVE_HEADER_BYTES > len)
+                return;
+            p = data + offset;
+            int rule = matchCarveRule(p);
+            if (rule < 0)
+            {
+                p += sector;
+                continue;
+            }
+            startCarve(scan, rule, p, pos + offset);
+            CarveHit hit = { CarveHit::HEADER, rule, scan.fileStart / sector, 0 };
+            hits.push_back(hit);
+        }
+        CarveStep_t step = stepCarve(scan, p, end);
+        const AdrType_t fileEnd = pos + (p - data) - scan.heldLen;
+        if (step == CARVE_DONE)
+        {
+            CarveHit hit = { CarveHit::FILE_END, scan.rule, scan.fileStart / sector, fileEnd - scan.fileStart };
+            hits.push_back(hit);
+        }
+        if ((step == CARVE_MORE) && (fileEnd - scan.fileStart <= CARVE_RULES[scan.rule].maxLen))
+            return;
+        // done, or not a file after all. Either way, look for the next one.
+        scan.rule = -1;
+        scan.heldLen = 0;
+        scan.skip = 0;
+    }
+}
+
+static inline AdrType_t isoLe32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<AdrType_t>(p[3]) << 24);
+}
+
+static inline unsigned isoLe16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+// the name in a directory entry or the path table. Joliet names are UCS-2, and written out as UTF-8.
+// The ";1" version, and the '.' ISO9660 puts on a name without an extension, are dropped.
+static std::string isoName(const unsigned char *id, unsigned len, bool joliet)
+{
+    std::string name;
+    if (!joliet)
+        name.assign(reinterpret_cast<const char *>(id), len);
+    else for (unsigned i = 0; i + 1 < len; i += 2)
+    {
+        unsigned long c = (id[i] << 8) | id[i + 1];
+        if ((c >= 0xD800) && (c < 0xDC00) && (i + 3 < len))
+        {   // a surrogate pair
+            const unsigned long low = (id[i + 2] << 8) | id[i + 3];
+            if ((low >= 0xDC00) && (low < 0xE000))
+            {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
+            }
+        }
+        if (c < 0x80)
+            name += static_cast<char>(c);
+        else if (c < 0x800)
+        {
+            name += static_cast<char>(0xC0 | (c >> 6));
+            name += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            name += static_cast<char>(0xE0 | (c >> 12));
+            name += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            name += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            name += static_cast<char>(0xF0 | (c >> 18));
+            name += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+            name += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            name += static_cast<char>(0x80 | (c & 0x3F));
+        }
+    }
+    const std::string::size_type semi = name.find(';');
+    if (semi != name.npos)
+        name.erase(semi);
+    if (!name.empty() && (name[name.size() - 1] == '.'))
+        name.erase(name.size() - 1);
+    return name;
+}
+
+// path + "/" + name, where name can't climb out of path or hide a separator
+static std::string joinIsoPath(const std::string &path, std::string name)
+{
+    for (size_t i = 0; i < name.size(); i++)
+        if ((name[i] == '/') || (name[i] == '\\') || !name[i])
+            name[i] = '_';
+    if (name.empty() || (name == ".") || (name == ".."))
+        name = "_";
+    return path.empty() ? name : path + "/" + name;
+}
+
+// no directory bigger than this is believed
+static const AdrType_t MAX_ISO_DIRECTORY = 64 * 1024 * 1024;
+// the volume descriptors start at this block, and this many are looked at
+static const AdrType_t ISO_FIRST_DESCRIPTOR = 16;
+static const AdrType_t ISO_MAX_DESCRIPTORS = 64;
+
+IsoFilesystem::IsoFilesystem(std::ostream &out, ImageFile &iso, const ExtentSet &rescued) : m_out(out), m_iso(iso), m_rescued(rescued),
+    m_blockSize(CDROM_BLOCK_SIZE), m_joliet(false), m_rockRidge(false), m_suspSkip(0)
+{}
+
+bool IsoFilesystem::readRescued(AdrType_t pos, AdrType_t len, std::vector<unsigned char> &buf)
+{
+    if (!len || (pos + len > m_iso.size()) || !m_rescued.contains(pos, len))
+        return false;
+    buf.resize(static_cast<size_t>(len));
+    return m_iso.read(pos, reinterpret_cast<char *>(&buf[0]), len);
+}
+
+// the primary and the Joliet supplementary volume descriptors, whichever were rescued
+bool IsoFilesystem::readVolumeDescriptors(std::vector<unsigned char> &pvd, std::vector<unsigned char> &svd)
+{
+    for (AdrType_t block = ISO_FIRST_DESCRIPTOR; block < ISO_FIRST_DESCRIPTOR + ISO_MAX_DESCRIPTORS; block++)
+    {
+        std::vector<unsigned char> vd;
+        if (!readRescued(block * CDROM_BLOCK_SIZE, CDROM_BLOCK_SIZE, vd))
+            continue;   // the ones after it may have been rescued
+        if (memcmp(&vd[1], "CD001", 5) != 0)
+            break;
+        if (vd[0] == 255)
+            break;      // the terminator
+        if ((vd[0] == 1) && pvd.empty())
+            pvd.swap(vd);
+        // Joliet is the supplementary descriptor with a UCS-2 escape sequence
+        else if ((vd[0] == 2) && svd.empty() && (vd[88] == 0x25) && (vd[89] == 0x2F) &&
+            ((vd[90] == 0x40) || (vd[90] == 0x43) || (vd[90] == 0x45)))
+            svd.swap(vd);
+    }
+    return !pvd.empty() || !svd.empty();
+}
+
+bool IsoFilesystem::read(FileList_t &files)
+{
+    std::vector<unsigned char> pvd;
+    std::vector<unsigned char> svd;
+    if (!readVolumeDescriptors(pvd, svd))
+        return false;
+
+    // Rock Ridge is in the primary tree. The "." entry of its root starts with the SUSP "SP" entry.
+    if (!pvd.empty())
+    {
+        std::vector<unsigned char> first;
+        const unsigned blockSize = isoLe16(&pvd[128]);
+        if (blockSize && readRescued(isoLe32(&pvd[156 + 2]) * blockSize, blockSize, first) && (first[0] >= 34 + 7))
+        {
+            const unsigned char *sp = &first[34];
+            if ((sp[0] == 'S') && (sp[1] == 'P') && (sp[4] == 0xBE) && (sp[5] == 0xEF))
+            {
+                m_rockRidge = true;
+                m_suspSkip = sp[6];
+            }
+        }
+    }
+    m_joliet = !m_rockRidge && !svd.empty();
+    const std::vector<unsigned char> &vd = m_joliet ? svd : pvd;
+    m_blockSize = isoLe16(&vd[128]);
+    if (!m_blockSize)
+        m_blockSize = CDROM_BLOCK_SIZE;
+
+    const unsigned char *root = &vd[156];
+    std::vector<Directory> pending(1, Directory(isoLe32(root + 2), isoLe32(root + 10), std::string()));
+    walk(pending, files);
+    if (m_unreadable.empty())
+        return true;
+
+    // Some directories were lost. The path table has every directory and its parent, so the
+    // ones below those can still be found. It lists parents before their children, and each
+    // is walked in turn, so a directory reached through its parent keeps its Rock Ridge name.
+    std::vector<Directory> table;
+    readPathTable(vd, table);
+    for (size_t i = 0; i < table.size(); i++)
+    {
+        pending.assign(1, table[i]);
+        walk(pending, files);
+    }
+    return true;
+}
+
+// every directory in the path table, with its path
+void IsoFilesystem::readPathTable(const std::vector<unsigned char> &vd, std::vector<Directory> &dirs)
+{
+    std::vector<unsigned char> table;
+    const AdrType_t size = isoLe32(&vd[132]);
+    if ((size > MAX_ISO_DIRECTORY) || !readRescued(isoLe32(&vd[140]) * m_blockSize, size, table))
+        return;
+    std::vector<std::string> paths;     // by the entry's number in the table, less one
+    for (size_t off = 0; off + 8 <= table.size(); )
+    {
+        const unsigned char *entry = &table[off];
+        const unsigned idLen = entry[0];
+        if (!idLen || (off + 8 + idLen > table.size()))
+            break;
+        const AdrType_t block = isoLe32(entry + 2);
+        const unsigned parent = isoLe16(entry + 6);
+        std::string path;
+        std::map<AdrType_t, std::string>::const_iterator found = m_paths.find(block);
+        if (found != m_paths.end())
+            path = found->second;
+        else if (!paths.empty())
+        {
+            if (!parent || (parent > paths.size()))
+                break;
+            path = joinIsoPath(paths[parent - 1], isoName(entry + 8, idLen, m_joliet));
+        }
+        paths.push_back(path);
+        dirs.push_back(Directory(block, 0, path));
+        off += 8 + idLen + (idLen & 1);
+    }
+}
+
+void IsoFilesystem::walk(std::vector<Directory> &pending, FileList_t &files)
+{
+    while (!pending.empty())
+    {
+        const Directory dir = pending.back();
+        pending.pop_back();
+        if (!m_paths.count(dir.block))
+            listDirectory(dir, pending, files);
+    }
+}
+
+// the files in one directory into files, and its subdirectories onto pending
+void IsoFilesystem::listDirectory(const Directory &dir, std::vector<Directory> &pending, FileList_t &files)
+{
+    const AdrType_t pos = dir.block * m_blockSize;
+    AdrType_t len = dir.len;
+    std::vector<unsigned char> data;
+    if (!len && readRescued(pos, m_blockSize, data) && (data[0] >= 34))
+        len = isoLe32(&data[10]);
+    m_paths[dir.block] = dir.path;
+    if ((len > MAX_ISO_DIRECTORY) || !readRescued(pos, len, data))
+    {
+        m_unreadable.push_back(dir.path.empty() ? "/" : dir.path);
+        m_unreadableExtents.push_back(Extent(pos, std::max(len, m_blockSize)));
+        return;
+    }
+
+    // a file over 4GB is in several entries in a row, all but the last flagged multi-extent
+    std::string partName;
+    FileDesc part;
+    bool partsJoin = true;
+    for (size_t off = 0; off < data.size(); )
+    {
+        const unsigned char *rec = &data[off];
+        const unsigned recLen = rec[0];
+        if (!recLen)
+        {   // entries don't cross a block. The rest of this one is padding.
+            off = static_cast<size_t>((off / m_blockSize + 1) * m_blockSize);
+            continue;
+        }
+        if ((recLen < 34) || (off + recLen > data.size()) || (33u + rec[32] > recLen))
+            break;
+        off += recLen;
+        const unsigned idLen = rec[32];
+        const unsigned flags = rec[25];
+        if (((idLen == 1) && (rec[33] <= 1)) || (flags & 4))
+            continue;   // "." and "..", and associated files
+        const std::string path = joinIsoPath(dir.path, recordName(rec));
+        const AdrType_t block = isoLe32(rec + 2);
+        const AdrType_t size = isoLe32(rec + 10);
+        if (flags & 2)
+        {
+            pending.push_back(Directory(block, size, path));
+            continue;
+        }
+        if (!partName.empty() && (path == partName))
+        {
+            partsJoin = partsJoin && (block * m_blockSize == part.pos + part.len);
+            part.len += size;
+        }
+        else
+        {
+            part = FileDesc(block * m_blockSize, size);
+            partsJoin = true;
+        }
+        if (flags & 0x80)
+        {
+            partName = path;
+            continue;
+        }
+        partName.clear();
+        if (partsJoin)
+            files.push_back(FileDesc(part.pos, part.len, path));
+        else
+            m_out << "The parts of " << path << " aren't contiguous, can't extract." << std::endl;
+    }
+}
+
+// the name of the entry, from Rock Ridge if the disc has it
+std::string IsoFilesystem::recordName(const unsigned char *rec)
+{
+    const unsigned idLen = rec[32];
+    if (m_rockRidge)
+    {
+        const unsigned su = 33 + idLen + ((idLen & 1) ? 0 : 1) + m_suspSkip;
+        std::string name;
+        if (su < rec[0])
+            rockRidgeName(rec + su, rec[0] - su, name, 0);
+        if (!name.empty())
+            return name;
+    }
+    return isoName(rec + 33, idLen, m_joliet);
+}
+
+// append the NM entries in a system use area to name. A CE entry says where the area goes on.
+void IsoFilesystem::rockRidgeName(const unsigned char *p, size_t len, std::string &name, int depth)
+{
+    const unsigned char *ce = 0;
+    while (len >= 4)
+    {
+        const unsigned entryLen = p[2];
+        if ((entryLen < 4) || (entryLen > len))
+            break;
+        // NM flags 2 and 4 are "." and ".."
+        if ((p[0] == 'N') && (p[1] == 'M') && (entryLen >= 5) && !(p[4] & 6))
+            name.append(reinterpret_cast<const char *>(p + 5), entryLen - 5);
+        else if ((p[0] == 'C') && (p[1] == 'E') && (entryLen >= 28))
+            ce = p;
+        else if ((p[0] == 'S') && (p[1] == 'T'))
+            break;
+        p += entryLen;
+        len -= entryLen;
+    }
+    std::vector<unsigned char> more;
+    if (ce && (depth < 8) &&
+        readRescued(isoLe32(ce + 4) * m_blockSize + isoLe32(ce + 12), isoLe32(ce + 20), more))
+        rockRidgeName(&more[0], more.size(), name, depth + 1);
+}
+
+/* ddrescue mapfile parsing.
+** The mapfile is read whole, or used in place where the caller has it mapped, and scanned by
+** hand rather than with a getline/sscanf per line. The mapfiles of a check are never mapped
+** (see IO_READ). Each data line is
+**      pos     size    status
+** in hex. The first non-comment line is ddrescue's current position and is skipped. */
+struct MapParse_t
+{
+    ExtentList_t extents;
+    MapEntryList_t entries; // every line, whatever its status, when asked for
+    AdrType_t totalBytes;
+    bool sorted;
+    MapParse_t() : totalBytes(0), sorted(true) {}
+};
+
+static inline const char *skipBlanks(const char *p, const char *end)
+{
+    while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r')))
+        p++;
+    return p;
+}
+
+// a hex number, with or without 0x. NULL if there are no digits at p.
+static inline const char *scanHex(const char *p, const char *end, AdrType_t &v)
+{
+    if ((end - p > 2) && (p[0] == '0') && ((p[1] | 0x20) == 'x'))
+        p += 2;
+    const char *first = p;
+    v = 0;
+    for (; p < end; p++)
+    {
+        unsigned d = static_cast<unsigned char>(*p) - '0';
+        if (d > 9)
+        {
+            d = (static_cast<unsigned char>(*p) | 0x20) - 'a';
+            if (d > 5)
+                break;
+            d += 10;
+        }
+        v = (v << 4) | d;
+    }
+    return (p == first) ? 0 : p;
+}
+
+// the start of the first line after ddrescue's current position line
+static const char *skipMapHeader(const char *p, const char *end)
+{
+    while (p < end)
+    {
+        const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        eol = eol ? eol + 1 : end;
+        const char *q = skipBlanks(p, eol);
+        if ((q < eol) && (*q != '\n') && (*q != '#'))
+            return eol;
+        p = eol;
+    }
+    return end;
+}
+
+static void parseMapLines(const char *p, const char *end, const bool *wanted, bool keepAll, MapParse_t &out)
+{
+    while (p < end)
+    {
+        const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        const char *line = p;
+        p = eol ? eol + 1 : end;
+        if (!eol)
+            eol = end;
+        const char *q = skipBlanks(line, eol);
+        if ((q == eol) || (*q == '#'))
+            continue;
+        AdrType_t addr(0);
+        AdrType_t len(0);
+        if (!(q = scanHex(q, eol, addr)))
+            continue;
+        q = skipBlanks(q, eol);
+        if (!(q = scanHex(q, eol, len)))
+            continue;
+        q = skipBlanks(q, eol);
+        if (q == eol)
+            continue;
+        if (keepAll && len)
+        {
+            MapEntry e = { addr, len, *q };
+            out.entries.push_back(e);
+        }
+        if (!wanted[static_cast<unsigned char>(*q)])
+            continue;
+
+        if (len == 0)
+        {
+            std::ostringstream oss;
+            oss << "oops got zero length in log \"" << std::string(line, eol) << "\"";
+            throw std::runtime_error(oss.str());
+        }
+
+        if (!out.extents.empty() && (addr < out.extents.back().pos))
+            out.sorted = false;
+        out.extents.push_back(Extent(addr, len));
+        out.totalBytes += len;
+    }
+}
+
+/* The -x triplets in an isodump listing. A triplet follows the first ']' of a line and ends
+** at ";1" after it:
+**      hex     block number (in --sector-size blocks)
+**      dec     length of the file in bytes
+**      a word that is skipped
+**      name    of the file
+** NUL bytes are dropped wherever they are (isodump's UTF-16 names are mostly ASCII with a NUL
+** between), by copying a line that has any into line, whose room is kept from line to line.
+** Other lines are parsed where they lie. A line that doesn't have all of the triplet is skipped. */
+static void parseTriplets(const char *p, const char *end, AdrType_t sectorSize, FileList_t &files)
+{
+    std::string line;
+    while (p < end)
+    {
+        const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        eol = eol ? eol : end;
+        const char *s = p;
+        const char *e = eol;
+        p = (eol < end) ? eol + 1 : end;
+        if (memchr(s, 0, e - s))
+        {
+            line.clear();
+            for (const char *q = s; q < e; q++)
+                if (*q)
+                    line.push_back(*q);
+            s = line.data();
+            e = s + line.size();
+        }
+        const char *bkt = static_cast<const char *>(memchr(s, ']', e - s));
+        if (!bkt)
+            continue;
+        s = bkt + 1;
+        const char *semi = s;
+        while ((semi = static_cast<const char *>(memchr(semi, ';', e - semi))) && (semi + 1 < e) && (semi[1] != '1'))
+            semi++;
+        if (!semi || (semi + 1 >= e))
+            continue;
+        e = semi;
+
+        AdrType_t block(0);
+        AdrType_t fileLen(0);
+        s = scanHex(skipBlanks(s, e), e, block);
+        if (!s)
+            continue;
+        s = skipBlanks(s, e);
+        const char *digits = s;
+        for (; (s < e) && (*s >= '0') && (*s <= '9'); s++)
+            fileLen = fileLen * 10 + (*s - '0');
+        if (s == digits)
+            continue;
+        s = skipBlanks(s, e);
+        while ((s < e) && !isspace(static_cast<unsigned char>(*s)))
+            s++;
+        const char *name = skipBlanks(s, e);
+        for (s = name; (s < e) && !isspace(static_cast<unsigned char>(*s)); s++)
+            ;
+        if (s == name)
+            continue;
+        files.push_back(FileDesc(block * sectorSize, fileLen, std::string(name, s)));
+    }
+}
+
+/* Put files in address order, keeping the order they were listed in among files at the same
+** address. A name already taken gets "~2", "~3"... before its extension, so that every file
+** of the listing is written, rather than the last of a name overwriting the others. Repeats
+** are found by sorting indexes by name, so a listing without any allocates nothing more. */
+static void sortFiles(FileList_t &files)
+{
+    std::stable_sort(files.begin(), files.end(), [](const FileDesc &a, const FileDesc &b) { return a.pos < b.pos; });
+    std::vector<size_t> byName(files.size());
+    for (size_t i = 0; i < byName.size(); i++)
+        byName[i] = i;
+    std::sort(byName.begin(), byName.end(), [&](size_t a, size_t b)
+        { int c = files[a].name.compare(files[b].name); return c ? (c < 0) : (a < b); });
+    // the first of a name, in address order, keeps it
+    std::vector<size_t> repeats;
+    for (size_t i = 1; i < byName.size(); i++)
+        if (files[byName[i]].name == files[byName[i - 1]].name)
+            repeats.push_back(byName[i]);
+    if (repeats.empty())
+        return;
+    std::sort(repeats.begin(), repeats.end());
+    std::set<std::string> taken;
+    for (size_t i = 0; i < files.size(); i++)
+        taken.insert(files[i].name);
+    std::map<std::string, unsigned> nextSuffix;
+    for (size_t i = 0; i < repeats.size(); i++)
+    {
+        std::string &name = files[repeats[i]].name;
+        const std::string::size_type slash = name.rfind('/');
+        std::string::size_type dot = name.rfind('.');
+        if ((dot == name.npos) || ((slash != name.npos) && (dot < slash)) || (dot == 0) || (dot == slash + 1))
+            dot = name.size();
+        unsigned &suffix = nextSuffix[name];
+        if (suffix < 2)
+            suffix = 2;
+        for (;; suffix++)
+        {
+            std::ostringstream renamed;
+            renamed << name.substr(0, dot) << '~' << suffix << name.substr(dot);
+            if (taken.insert(renamed.str()).second)
+            {
+                name = renamed.str();
+                break;
+            }
+        }
+    }
+}
+
+// parse the ddrescue log file for what we want from it.
+// entries, if given, gets every line of the mapfile in address order, whatever its status.
+void readLog(std::ostream &out, ImageFile &log, const std::string &fname, const std::string &statusChars,
+    WorkPool &pool, ExtentSet &res, MapEntryList_t *entries)
+{
+    bool wanted[256] = {false};
+    for (size_t i = 0; i < statusChars.size(); i++)
+        wanted[static_cast<unsigned char>(statusChars[i])] = true;
+
+    std::vector<char> copy;
+    const char *text = reinterpret_cast<const char *>(log.map(0, log.size()));
+    if (!text && log.size())
+    {
+        copy.resize(static_cast<size_t>(log.size()));
+        if (!log.read(0, &copy[0], log.size()))
+            throw std::runtime_error(std::string("Failed to read ") + log.name());
+        text = &copy[0];
+    }
+    const char *end = text + log.size();
+    const char *p = skipMapHeader(text, end);
+
+    // A big mapfile is cut at line boundaries and the pieces parsed in parallel.
+    static const AdrType_t PARALLEL_PARSE_MIN = 16 * 1024 * 1024;
+    std::vector<const char *> cuts(1, p);
+    if ((pool.threads() > 1) && (static_cast<AdrType_t>(end - p) >= PARALLEL_PARSE_MIN))
+    {
+        for (unsigned i = 1; i < pool.threads(); i++)
+        {
+            const char *cut = p + (end - p) * i / pool.threads();
+            if (cut <= cuts.back())
+                continue;
+            const char *eol = static_cast<const char *>(memchr(cut, '\n', end - cut));
+            if (!eol)
+                break;
+            cuts.push_back(eol + 1);
+        }
+    }
+    cuts.push_back(end);
+    std::vector<MapParse_t> parts(cuts.size() - 1);
+    pool.run(parts.size(), [&](size_t i, unsigned)
+    {
+        parseMapLines(cuts[i], cuts[i + 1], wanted, entries != 0, parts[i]);
+    });
+
+    MapParse_t &found = parts[0];
+    for (size_t i = 1; i < parts.size(); i++)
+    {
+        if (!parts[i].extents.empty() && !found.extents.empty() &&
+            (parts[i].extents.front().pos < found.extents.back().pos))
+            found.sorted = false;
+        found.sorted = found.sorted && parts[i].sorted;
+        found.totalBytes += parts[i].totalBytes;
+        found.extents.insert(found.extents.end(), parts[i].extents.begin(), parts[i].extents.end());
+        found.entries.insert(found.entries.end(), parts[i].entries.begin(), parts[i].entries.end());
+    }
+
+    // ddrescue writes its mapfile in address order, but don't count on it
+    if (!found.sorted)
+        std::stable_sort(found.extents.begin(), found.extents.end(),
+            [](const Extent &a, const Extent &b) { return a.pos < b.pos; });
+    if (entries)
+    {
+        std::stable_sort(found.entries.begin(), found.entries.end(),
+            [](const MapEntry &a, const MapEntry &b) { return a.pos < b.pos; });
+        entries->swap(found.entries);
+    }
+
+    // One pass checks for overlaps. Selecting several status characters gives
+    // neighbouring extents that touch, and those are joined.
+    res.clear();
+    res.reserve(found.extents.size());
+    for (size_t i = 0; i < found.extents.size(); i++)
+    {
+        const Extent &e = found.extents[i];
+        if (!res.empty())
+        {
+            const Extent &last = res[res.size() - 1];
+            if (e.pos < last.pos + last.len)
+            {
+                std::ostringstream oss;
+                oss << "oops overlap of existing 0x" << std::hex << last.pos << 
+                    " 0x" << std::hex << last.len << 
+                    " with 0x" << std::hex << e.pos << " 0x" << std::hex << e.len;
+                throw std::runtime_error(oss.str());
+            }
+        }
+        res.append(e.pos, e.len);
+    }
+    res.coalesce();
+    if (statusChars == "+")
+        out << "Total bytes rescued in \"" << fname << "\" " << std::dec << found.totalBytes << std::endl;
+    else
+        out << "Total bytes with status \"" << statusChars << "\" in \"" << fname << "\" " << 
+            std::dec << found.totalBytes << std::endl;
+}
+
+// create the directory name, if it isn't there already
+bool makeDirectory(const std::string &name)
+{
+#if defined(DDRESCUECMP_POSIX)
+    if (::mkdir(name.c_str(), 0777) == 0)
+        return true;
+    struct stat st;
+    return (errno == EEXIST) && (::stat(name.c_str(), &st) == 0) && S_ISDIR(st.st_mode);
+#else
+    return (::_mkdir(name.c_str()) == 0) || (errno == EEXIST);
+#endif
+}
+
+// ddrescue's current status, from the line just before the blocks. '+' once it has finished.
+static char mapfileStatus(ImageFile &log)
+{
+    // the status line is near the top, after a few comments
+    const AdrType_t len = std::min<AdrType_t>(log.size(), 64 * 1024);
+    std::vector<char> copy;
+    const char *text = reinterpret_cast<const char *>(log.map(0, len));
+    if (!text)
+    {
+        if (!len)
+            return 0;
+        copy.resize(static_cast<size_t>(len));
+        if (!log.read(0, &copy[0], len))
+            return 0;
+        text = &copy[0];
+    }
+    const char *end = text + len;
+    for (const char *p = text; p < end; )
+    {
+        const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        if (!eol)
+            eol = end;
+        const char *q = skipBlanks(p, eol);
+        if ((q < eol) && (*q != '#'))
+        {
+            AdrType_t pos(0);
+            if (!(q = scanHex(q, eol, pos)))
+                return 0;
+            q = skipBlanks(q, eol);
+            return (q < eol) ? *q : 0;
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+void ExtentSet::coalesce()
+{
+    if (m_extents.empty())
+        return;
+    size_t out = 0;
+    for (size_t i = 1; i < m_extents.size(); i++)
+    {
+        Extent &last = m_extents[out];
+        if (m_extents[i].pos <= last.pos + last.len)
+            last.len = std::max(last.pos + last.len, m_extents[i].pos + m_extents[i].len) - last.pos;
+        else
+            m_extents[++out] = m_extents[i];
+    }
+    m_extents.resize(out + 1);
+}
+
+ExtentSet::const_iterator ExtentSet::find(AdrType_t pos) const
+{
+    // first extent starting after pos. The one before it is the only candidate.
+    const_iterator itor = std::upper_bound(m_extents.begin(), m_extents.end(), pos,
+        [](AdrType_t p, const Extent &e) { return p < e.pos; });
+    if (itor == m_extents.begin())
+        return m_extents.end();
+    --itor;
+    return (pos < itor->pos + itor->len) ? itor : m_extents.end();
+}
+
+bool ExtentSet::contains(AdrType_t pos, AdrType_t len) const
+{
+    const_iterator itor = find(pos);
+    return (itor != end()) && (pos + len <= itor->pos + itor->len);
+}
+
+ExtentSet ExtentSet::within(AdrType_t pos, AdrType_t len) const
+{
+    // first extent ending after pos
+    const_iterator itor = std::upper_bound(m_extents.begin(), m_extents.end(), pos,
+        [](AdrType_t p, const Extent &e) { return p < e.pos + e.len; });
+    ExtentSet parts;
+    for (const AdrType_t end = pos + len; (itor != m_extents.end()) && (itor->pos < end); ++itor)
+    {
+        const AdrType_t from = std::max(pos, itor->pos);
+        parts.append(from, std::min(end, itor->pos + itor->len) - from);
+    }
+    return parts;
+}
+
+AdrType_t ExtentSet::totalBytes() const
+{
+    AdrType_t total = 0;
+    for (size_t i = 0; i < m_extents.size(); i++)
+        total += m_extents[i].len;
+    return total;
+}
+
+ExtentSet ExtentSet::intersect(const ExtentSet &a, const ExtentSet &b)
+{
+    ExtentSet res;
+    size_t i = 0, j = 0;
+    while ((i < a.size()) && (j < b.size()))
+    {
+        AdrType_t aEnd = a[i].pos + a[i].len;
+        AdrType_t bEnd = b[j].pos + b[j].len;
+        AdrType_t begin = std::max(a[i].pos, b[j].pos);
+        AdrType_t end = std::min(aEnd, bEnd);
+        if (begin < end)
+            res.m_extents.push_back(Extent(begin, end - begin));
+        if (aEnd < bEnd)
+            i++;
+        else
+            j++;
+    }
+    return res;
+}
+
+ExtentSet ExtentSet::unite(const ExtentSet &a, const ExtentSet &b)
+{
+    ExtentSet res;
+    res.reserve(a.size() + b.size());
+    size_t i = 0, j = 0;
+    while ((i < a.size()) || (j < b.size()))
+    {
+        const Extent &e = ((j >= b.size()) || ((i < a.size()) && (a[i].pos <= b[j].pos))) ? a[i++] : b[j++];
+        if (!res.empty() && (e.pos <= res.m_extents.back().pos + res.m_extents.back().len))
+        {
+            Extent &last = res.m_extents.back();
+            last.len = std::max(last.pos + last.len, e.pos + e.len) - last.pos;
+        }
+        else
+            res.m_extents.push_back(e);
+    }
+    return res;
+}
+
+ExtentSet ExtentSet::subtract(const ExtentSet &a, const ExtentSet &b)
+{
+    ExtentSet res;
+    size_t j = 0;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        AdrType_t pos = a[i].pos;
+        AdrType_t end = a[i].pos + a[i].len;
+        while ((j < b.size()) && (b[j].pos + b[j].len <= pos))
+            j++;
+        for (size_t k = j; (k < b.size()) && (b[k].pos < end); k++)
+        {
+            if (b[k].pos > pos)
+                res.m_extents.push_back(Extent(pos, b[k].pos - pos));
+            pos = std::max(pos, b[k].pos + b[k].len);
+        }
+        if (pos < end)
+            res.m_extents.push_back(Extent(pos, end - pos));
+    }
+    return res;
+}
+
+static inline AdrType_t gzLe64(const unsigned char *p)
+{
+    AdrType_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static inline void putGzLe64(unsigned char *p, AdrType_t v)
+{
+    for (int i = 0; i < 8; i++, v >>= 8)
+        p[i] = static_cast<unsigned char>(v);
+}
+
+// a -gz trailer up to its 5 numbers: a gzip header with just an extra field, the 'D','C' subfield
+static const unsigned char GZ_TRAILER_HEAD[16] = {0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 44, 0, 'D', 'C', 40, 0};
+// and after them: an empty final deflate block, and the CRC and length of nothing
+static const unsigned char GZ_TRAILER_TAIL[10] = {3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+static bool gzFrameBefore(const GzFrame &a, const GzFrame &b)
+{
+    return a.pos < b.pos;
+}
+
+#if defined(DDRESCUECMP_ZLIB)
+// the biggest frame a trailer may claim, and the most a frame of n bytes can take to store
+static const AdrType_t MAX_GZ_FRAME = 64 << 20;
+static AdrType_t maxGzMember(AdrType_t n) { return n + n / 8 + 4096; }
+
+// inflate the gzip member packed into exactly len bytes at out. false if it is damaged or not that long.
+static bool inflateMember(const char *packed, AdrType_t packedLen, unsigned char *out, AdrType_t len)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+        return false;
+    z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(packed));
+    z.avail_in = static_cast<uInt>(packedLen);
+    z.next_out = out;
+    z.avail_out = static_cast<uInt>(len);
+    // the end of the member, with its CRC and length checked, or a Z_BUF_ERROR if there is more
+    const int res = ::inflate(&z, Z_FINISH);
+    const bool ok = (res == Z_STREAM_END) && (z.total_out == len) && (z.avail_in == 0);
+    inflateEnd(&z);
+    return ok;
+}
+
+// deflate len bytes at data into packed, as a gzip member of their own
+static bool deflateMember(const unsigned char *data, AdrType_t len, std::vector<unsigned char> &packed)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    packed.resize(static_cast<size_t>(deflateBound(&z, static_cast<uLong>(len))));
+    z.next_in = const_cast<Bytef *>(data);
+    z.avail_in = static_cast<uInt>(len);
+    z.next_out = &packed[0];
+    z.avail_out = static_cast<uInt>(packed.size());
+    const int res = ::deflate(&z, Z_FINISH);
+    packed.resize(static_cast<size_t>(z.total_out));
+    deflateEnd(&z);
+    return res == Z_STREAM_END;
+}
+#endif
+
+/* The index of a -gz image, and the frames last inflated from it. A read inflates only the frames
+** it touches. When INFLATE_THREADS or more of them aren't cached, they are inflated at the same
+** time, on that many threads. The last FRAME_CACHE frames inflated stay, so the chunks of an
+** extent, or small files next to each other, that share a frame don't inflate it again. A thread
+** that wants a frame another one is inflating waits for it. */
+class ImageFile::Frames
+{
+public:
+    // index is taken, and is in address order
+    Frames(ImageFile &file, AdrType_t size, AdrType_t frameSize, std::vector<GzFrame> &index);
+    AdrType_t size() const { return m_size; }
+    bool read(AdrType_t pos, char *buf, AdrType_t len);
+    ExtentSet holes() const;
+private:
+    Frames(const Frames &);
+    Frames &operator = (const Frames &);
+    typedef std::shared_ptr<const std::vector<unsigned char> > Data_t;
+    struct Cached {
+        Data_t data;    // NULL while a thread inflates it
+        std::list<size_t>::iterator recent;
+    };
+    static const size_t FRAME_CACHE = 32;
+    static const unsigned INFLATE_THREADS = 4;
+    // m_index[i], inflated. NULL if it can't be read.
+    Data_t frame(size_t i);
+    ImageFile &m_file;
+    AdrType_t m_size;
+    AdrType_t m_frameSize;
+    std::vector<GzFrame> m_index;
+    std::mutex m_lock;
+    std::condition_variable m_inflated;
+    std::map<size_t, Cached> m_cache;   // by the frame's index in m_index
+    std::list<size_t> m_recent;         // the frames in m_cache that have data, last used first
+};
+
+ImageFile::Frames::Frames(ImageFile &file, AdrType_t size, AdrType_t frameSize, std::vector<GzFrame> &index) :
+    m_file(file), m_size(size), m_frameSize(frameSize)
+{
+    m_index.swap(index);
+}
+
+bool ImageFile::Frames::read(AdrType_t pos, char *buf, AdrType_t len)
+{
+    if ((pos > m_size) || (len > m_size - pos))
+        return false;
+    // the stored frames [first, last) that the read touches
+    const GzFrame key = { pos / m_frameSize * m_frameSize, 0, 0 };
+    const size_t first = std::lower_bound(m_index.begin(), m_index.end(), key, gzFrameBefore) - m_index.begin();
+    size_t last = first;
+    while ((last < m_index.size()) && (m_index[last].pos < pos + len))
+        last++;
+    std::vector<Data_t> data(last - first);
+    std::vector<size_t> missing;
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        for (size_t i = first; i < last; i++)
+        {
+            std::map<size_t, Cached>::iterator itor = m_cache.find(i);
+            if ((itor == m_cache.end()) || !itor->second.data)
+            {
+                missing.push_back(i);
+                continue;
+            }
+            data[i - first] = itor->second.data;
+            m_recent.splice(m_recent.begin(), m_recent, itor->second.recent);
+        }
+    }
+    // A WorkPool starts its threads on each run, which only pays for a read of several frames,
+    // such as a chunk of a compare or scan. The small reads of -x and -fs inflate theirs here.
+    if (missing.size() < INFLATE_THREADS)
+    {
+        for (size_t k = 0; k < missing.size(); k++)
+            data[missing[k] - first] = frame(missing[k]);
+    }
+    else
+    {
+        WorkPool inflaters(INFLATE_THREADS);
+        inflaters.run(missing.size(), [&](size_t k, unsigned)
+        {
+            data[missing[k] - first] = frame(missing[k]);
+        });
+    }
+
+    // the frames, and zeros between them
+    const AdrType_t end = pos + len;
+    AdrType_t done = pos;
+    for (size_t i = first; i < last; i++)
+    {
+        const Data_t &d = data[i - first];
+        if (!d)
+            return false;
+        const AdrType_t from = std::max(pos, m_index[i].pos);
+        const AdrType_t to = std::min(end, m_index[i].pos + d->size());
+        if (from > done)
+            memset(buf + (done - pos), 0, static_cast<size_t>(from - done));
+        memcpy(buf + (from - pos), &(*d)[static_cast<size_t>(from - m_index[i].pos)], static_cast<size_t>(to - from));
+        done = to;
+    }
+    if (end > done)
+        memset(buf + (done - pos), 0, static_cast<size_t>(end - done));
+    return true;
+}
+
+ImageFile::Frames::Data_t ImageFile::Frames::frame(size_t i)
+{
+    std::unique_lock<std::mutex> g(m_lock);
+    for (;;)
+    {
+        std::map<size_t, Cached>::iterator itor = m_cache.find(i);
+        if (itor == m_cache.end())
+            break;
+        if (itor->second.data)
+        {
+            m_recent.splice(m_recent.begin(), m_recent, itor->second.recent);
+            return itor->second.data;
+        }
+        m_inflated.wait(g);
+    }
+    m_cache[i];
+    g.unlock();
+
+    std::shared_ptr<std::vector<unsigned char> > inflated;
+    try {
+#if defined(DDRESCUECMP_ZLIB)
+        const GzFrame &f = m_index[i];
+        std::vector<char> packed(static_cast<size_t>(f.length));
+        if (m_file.readFile(f.offset, &packed[0], f.length))
+        {
+            m_file.dropFile(f.offset, f.length);
+            inflated.reset(new std::vector<unsigned char>(static_cast<size_t>(std::min(m_frameSize, m_size - f.pos))));
+            if (!inflateMember(&packed[0], f.length, &(*inflated)[0], inflated->size()))
+                inflated.reset();
+        }
+#endif
+    }
+    catch (...)
+    {
+        g.lock();
+        m_cache.erase(i);
+        m_inflated.notify_all();
+        throw;
+    }
+
+    g.lock();
+    if (!inflated)
+        m_cache.erase(i);
+    else
+    {
+        Cached &c = m_cache[i];
+        c.data = inflated;
+        m_recent.push_front(i);
+        c.recent = m_recent.begin();
+        while (m_recent.size() > FRAME_CACHE)
+        {
+            m_cache.erase(m_recent.back());
+            m_recent.pop_back();
+        }
+    }
+    m_inflated.notify_all();
+    return inflated;
+}
+
+ExtentSet ImageFile::Frames::holes() const
+{
+    ExtentSet found;
+    AdrType_t pos = 0;
+    for (size_t i = 0; i < m_index.size(); i++)
+    {
+        if (m_index[i].pos > pos)
+            found.append(pos, m_index[i].pos - pos);
+        pos = std::min(m_size, m_index[i].pos + m_frameSize);
+    }
+    if (m_size > pos)
+        found.append(pos, m_size - pos);
+    return found;
+}
+
+ImageFile::ImageFile() : m_size(0), m_map(0), m_policy(IO_CACHED), m_io(0)
+#if defined(DDRESCUECMP_POSIX)
+    , m_fd(-1), m_directFd(-1)
+#endif
+{}
+
+ImageFile::~ImageFile()
+{
+    close();
+}
+
+void ImageFile::close()
+{
+    m_frames.reset();
+#if defined(DDRESCUECMP_POSIX)
+    if (m_map)
+        ::munmap(const_cast<unsigned char *>(m_map), static_cast<size_t>(m_size));
+    if (m_fd >= 0)
+        ::close(m_fd);
+    if (m_directFd >= 0)
+        ::close(m_directFd);
+    m_fd = -1;
+    m_directFd = -1;
+#else
+    if (m_stream.is_open())
+        m_stream.close();
+    m_stream.clear();
+#endif
+    m_map = 0;
+    m_size = 0;
+}
+
+bool ImageFile::open(const std::string &name, IoPolicy_t policy)
+{
+    close();
+    m_name = name;
+    m_policy = policy;
+#if defined(DDRESCUECMP_POSIX)
+    m_fd = ::open(name.c_str(), O_RDONLY);
+    if (m_fd < 0)
+        return false;
+    struct stat st;
+    if (::fstat(m_fd, &st) != 0)
+        return false;
+    m_size = static_cast<AdrType_t>(st.st_size);
+    if (findFrames())
+        return compressed();
+    if (policy == IO_READ)
+        return true;
+    if (policy != IO_CACHED)
+    {   // read with pread, not mapped: a map would fill the page cache
+#if defined(POSIX_FADV_SEQUENTIAL)
+        ::posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        if (policy == IO_DIRECT)
+        {   // where O_DIRECT can't be had, this is the same as IO_STREAM
+#if defined(O_DIRECT)
+            m_directFd = ::open(name.c_str(), O_RDONLY | O_DIRECT);
+#elif defined(F_NOCACHE)
+            m_directFd = ::open(name.c_str(), O_RDONLY);
+            if ((m_directFd >= 0) && (::fcntl(m_directFd, F_NOCACHE, 1) != 0))
+            {
+                ::close(m_directFd);
+                m_directFd = -1;
+            }
+#endif
+        }
+        return true;
+    }
+    // a 32 bit build can't map a DVD image. Just don't map it and use pread instead.
+    if ((m_size > 0) && (m_size == static_cast<size_t>(m_size)))
+    {
+        void *p = ::mmap(0, static_cast<size_t>(m_size), PROT_READ, MAP_SHARED, m_fd, 0);
+        if (p != MAP_FAILED)
+        {
+            ::madvise(p, static_cast<size_t>(m_size), MADV_SEQUENTIAL);
+            m_map = static_cast<const unsigned char *>(p);
+        }
+    }
+    return true;
+#else
+    m_stream.open(name.c_str(), std::ifstream::binary);
+    if (!m_stream.is_open())
+        return false;
+    m_stream.seekg(0, std::ios::end);
+    m_size = static_cast<AdrType_t>(m_stream.tellg());
+    if (findFrames())
+        return compressed();
+    return true;
+#endif
+}
+
+bool ImageFile::findFrames()
+{
+    unsigned char t[GZ_TRAILER_SIZE];
+    if ((m_size < GZ_TRAILER_SIZE) || !readFile(m_size - GZ_TRAILER_SIZE, reinterpret_cast<char *>(t), GZ_TRAILER_SIZE) ||
+        memcmp(t, GZ_TRAILER_HEAD, sizeof(GZ_TRAILER_HEAD)) ||
+        memcmp(t + GZ_TRAILER_SIZE - sizeof(GZ_TRAILER_TAIL), GZ_TRAILER_TAIL, sizeof(GZ_TRAILER_TAIL)))
+        return false;
+#if defined(DDRESCUECMP_ZLIB)
+    const unsigned char *n = t + sizeof(GZ_TRAILER_HEAD);
+    const AdrType_t indexOffset = gzLe64(n);
+    const AdrType_t indexLength = gzLe64(n + 8);
+    const AdrType_t size = gzLe64(n + 16);
+    const AdrType_t frameSize = gzLe64(n + 24);
+    const AdrType_t count = gzLe64(n + 32);
+    // whatever a damaged trailer says mustn't have us allocate the earth
+    const AdrType_t end = m_size - GZ_TRAILER_SIZE;
+    if (!frameSize || (frameSize > MAX_GZ_FRAME) || (count > size / frameSize + 1) || (indexOffset >= end) ||
+        (indexLength != end - indexOffset) || (indexLength > maxGzMember(count * GZ_INDEX_ENTRY)))
+        return true;
+    std::vector<char> packed(static_cast<size_t>(indexLength));
+    std::vector<unsigned char> table(static_cast<size_t>(count * GZ_INDEX_ENTRY) + 1);   // not empty, for &table[0]
+    if (!readFile(indexOffset, &packed[0], indexLength) ||
+        !inflateMember(&packed[0], indexLength, &table[0], count * GZ_INDEX_ENTRY))
+        return true;
+    std::vector<GzFrame> index(static_cast<size_t>(count));
+    AdrType_t next = 0;     // the first address the next frame may have
+    for (size_t i = 0; i < index.size(); i++)
+    {
+        const unsigned char *e = &table[i * GZ_INDEX_ENTRY];
+        GzFrame &f = index[i];
+        f.pos = gzLe64(e);
+        f.offset = gzLe64(e + 8);
+        f.length = gzLe64(e + 16);
+        if ((f.pos < next) || (f.pos % frameSize) || (f.pos >= size) || !f.length ||
+            (f.length > maxGzMember(frameSize)) || (f.offset > indexOffset) || (f.length > indexOffset - f.offset))
+            return true;
+        next = f.pos + frameSize;
+    }
+    m_frames.reset(new Frames(*this, size, frameSize, index));
+    m_size = size;
+#endif
+    return true;
+}
+
+const unsigned char *ImageFile::map(AdrType_t pos, AdrType_t len) const
+{
+    if (!m_map || (pos > m_size) || (len > m_size - pos))
+        return 0;
+    return m_map + pos;
+}
+
+bool ImageFile::read(AdrType_t pos, char *buf, AdrType_t len)
+{
+    if (m_frames)
+        return m_frames->read(pos, buf, len);
+    const unsigned char *p = map(pos, len);
+    if (p)
+    {
+        memcpy(buf, p, static_cast<size_t>(len));
+        return true;
+    }
+    if (!readFile(pos, buf, len))
+        return false;
+    doneWith(pos, len);
+    return true;
+}
+
+bool ImageFile::readFile(AdrType_t pos, char *buf, AdrType_t len)
+{
+#if defined(DDRESCUECMP_POSIX)
+    while (len > 0)
+    {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        unsigned calls = 1;
+        bool direct = false;
+        ssize_t c = -1;
+        // O_DIRECT takes whole sectors into an aligned buffer. Anything else, such as the
+        // end of the file, or a device with bigger sectors (EINVAL), goes through the cache.
+        if ((m_directFd >= 0) && !(pos % DIRECT_IO_SECTOR) && !(len % DIRECT_IO_SECTOR) &&
+            !(reinterpret_cast<uintptr_t>(buf) % DIRECT_IO_ALIGN))
+        {
+            direct = true;
+            c = ::pread(m_directFd, buf, static_cast<size_t>(len), static_cast<off_t>(pos));
+        }
+        if (c < 0)
+        {
+            calls += direct;    // the O_DIRECT read failed, this is the second call
+            c = ::pread(m_fd, buf, static_cast<size_t>(len), static_cast<off_t>(pos));
+        }
+        if (m_io)
+            m_io->count(calls, (c > 0) ? c : 0, start);
+        if (c <= 0)
+            return false;
+        buf += c;
+        pos += c;
+        len -= c;
+    }
+    return true;
+#else
+    std::lock_guard<std::mutex> g(m_streamLock);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    m_stream.clear();
+    m_stream.seekg(pos);
+    m_stream.read(buf, len);
+    if (m_io)
+        m_io->count(1, static_cast<AdrType_t>(m_stream.gcount()), start);
+    return m_stream.gcount() == static_cast<std::streamsize>(len);
+#endif
+}
+
+void ImageFile::doneWith(AdrType_t pos, AdrType_t len)
+{
+    // a -gz image drops the frames it reads as it reads them
+    if (!m_frames)
+        dropFile(pos, len);
+}
+
+void ImageFile::dropFile(AdrType_t pos, AdrType_t len)
+{
+#if defined(DDRESCUECMP_POSIX) && defined(POSIX_FADV_DONTNEED)
+    // The page cache holds a file in folios of up to 2MB, and only drops the ones wholly inside
+    // the range. Extents start on 2048 byte blocks, so the range is widened back to a folio, and
+    // the folio it ends in is left for the next range, which starts in it.
+    static const AdrType_t FOLIO = 2 * 1024 * 1024;
+    if ((m_policy == IO_CACHED) || (m_policy == IO_READ))
+        return;
+    const AdrType_t begin = pos / FOLIO * FOLIO;
+    const AdrType_t end = (pos + len >= m_size) ? m_size : (pos + len) / FOLIO * FOLIO;
+    if (end > begin)
+        ::posix_fadvise(m_fd, static_cast<off_t>(begin), static_cast<off_t>(end - begin), POSIX_FADV_DONTNEED);
+#else
+    (void)pos;
+    (void)len;
+#endif
+}
+
+ExtentSet ImageFile::holes() const
+{
+    if (m_frames)
+        return m_frames->holes();
+    ExtentSet found;
+#if defined(DDRESCUECMP_POSIX) && defined(SEEK_HOLE) && defined(SEEK_DATA)
+    // Two seeks a hole, and one to find there are none. The end of the file counts as a hole.
+    const off_t size = static_cast<off_t>(m_size);
+    for (off_t pos = 0; pos < size; )
+    {
+        const off_t hole = ::lseek(m_fd, pos, SEEK_HOLE);
+        if ((hole < 0) || (hole >= size))
+            break;
+        off_t data = ::lseek(m_fd, hole, SEEK_DATA);
+        if ((data < 0) || (data > size))
+            data = size;   // ENXIO: no data after the hole
+        found.append(static_cast<AdrType_t>(hole), static_cast<AdrType_t>(data - hole));
+        pos = data;
+    }
+#endif
+    return found;
+}
+
+static char *alignedAlloc(size_t size)
+{
+#if defined(DDRESCUECMP_POSIX)
+    void *p = 0;
+    if (::posix_memalign(&p, DIRECT_IO_ALIGN, size) != 0)
+        throw std::bad_alloc();
+    return static_cast<char *>(p);
+#else
+    char *p = static_cast<char *>(::_aligned_malloc(size, DIRECT_IO_ALIGN));
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+#endif
+}
+
+static void alignedFree(char *p)
+{
+#if defined(DDRESCUECMP_POSIX)
+    ::free(p);
+#else
+    ::_aligned_free(p);
+#endif
+}
+
+/* The buffers AlignedBuffers are done with, for the next one that wants the same size. The jobs
+** of a -batch and the passes of --follow then reuse the memory of the ones before them rather
+** than each allocating its own. No more than SPARE_BUFFER_BYTES are kept. */
+static const size_t SPARE_BUFFER_BYTES = 128 << 20;
+
+class SpareBuffers
+{
+public:
+    SpareBuffers() : m_bytes(0) {}
+    ~SpareBuffers()
+    {
+        for (std::multimap<size_t, char *>::iterator itor = m_spare.begin(); itor != m_spare.end(); itor++)
+            alignedFree(itor->second);
+    }
+    // a spare buffer of exactly size bytes, or 0
+    char *take(size_t size)
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        std::multimap<size_t, char *>::iterator itor = m_spare.find(size);
+        if (itor == m_spare.end())
+            return 0;
+        char *p = itor->second;
+        m_spare.erase(itor);
+        m_bytes -= size;
+        return p;
+    }
+    void give(char *p, size_t size)
+    {
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            if (m_bytes + size <= SPARE_BUFFER_BYTES)
+            {
+                m_spare.insert(std::make_pair(size, p));
+                m_bytes += size;
+                return;
+            }
+        }
+        alignedFree(p);
+    }
+private:
+    std::mutex m_lock;
+    std::multimap<size_t, char *> m_spare;
+    size_t m_bytes;
+};
+
+static SpareBuffers &spareBuffers()
+{
+    static SpareBuffers spare;
+    return spare;
+}
+
+AlignedBuffer::AlignedBuffer(size_t size) : m_data(0), m_size(0)
+{
+    resize(size);
+}
+
+AlignedBuffer::~AlignedBuffer()
+{
+    resize(0);
+}
+
+void AlignedBuffer::resize(size_t size)
+{
+    if (m_data)
+        spareBuffers().give(m_data, m_size);
+    m_data = 0;
+    m_size = 0;
+    if (!size)
+        return;
+    m_data = spareBuffers().take(size);
+    if (!m_data)
+        m_data = alignedAlloc(size);
+    m_size = size;
+}
+
+/* Find the first differing byte of two buffers.
+** The vector kernels compare a block of bytes at a time and only drop to bytes
+** to locate the difference inside the block that has one. */
+static AdrType_t firstMismatchPortable(const unsigned char *a, const unsigned char *b, AdrType_t len)
+{
+    AdrType_t i = 0;
+    for (; i + sizeof(unsigned long long) <= len; i += sizeof(unsigned long long))
+    {
+        unsigned long long v1, v2;
+        memcpy(&v1, a + i, sizeof(v1));
+        memcpy(&v2, b + i, sizeof(v2));
+        if (v1 != v2)
+            break;
+    }
+    for (; i < len; i++)
+        if (a[i] != b[i])
+            return i;
+    return len;
+}
+
+#if defined(DDRESCUECMP_X86_DISPATCH)
+__attribute__((target("avx2")))
+static AdrType_t firstMismatchAvx2(const unsigned char *a, const unsigned char *b, AdrType_t len)
+{
+    AdrType_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m256i e0 = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i)));
+        __m256i e1 = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i + 32)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i + 32)));
+        if (static_cast<unsigned>(_mm256_movemask_epi8(_mm256_and_si256(e0, e1))) != 0xFFFFFFFFu)
+        {
+            unsigned m0 = ~static_cast<unsigned>(_mm256_movemask_epi8(e0));
+            if (m0)
+                return i + __builtin_ctz(m0);
+            return i + 32 + __builtin_ctz(~static_cast<unsigned>(_mm256_movemask_epi8(e1)));
+        }
+    }
+    return i + firstMismatchPortable(a + i, b + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static AdrType_t firstMismatchSse2(const unsigned char *a, const unsigned char *b, AdrType_t len)
+{
+    AdrType_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        unsigned m = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)),
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)))));
+        if (m != 0xFFFFu)
+            return i + __builtin_ctz(~m);
+    }
+    return i + firstMismatchPortable(a + i, b + i, len - i);
+}
+#elif defined(DDRESCUECMP_SSE2)
+static AdrType_t firstMismatchSse2(const unsigned char *a, const unsigned char *b, AdrType_t len)
+{
+    AdrType_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        unsigned m = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)),
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)))));
+        if (m != 0xFFFFu)
+        {
+            unsigned long bit;
+            _BitScanForward(&bit, ~m);
+            return i + bit;
+        }
+    }
+    return i + firstMismatchPortable(a + i, b + i, len - i);
+}
+#elif defined(DDRESCUECMP_NEON)
+static AdrType_t firstMismatchNeon(const unsigned char *a, const unsigned char *b, AdrType_t len)
+{
+    AdrType_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        if (vminvq_u8(eq) != 0xFF)
+            return i + firstMismatchPortable(a + i, b + i, 16);
+    }
+    return i + firstMismatchPortable(a + i, b + i, len - i);
+}
+#endif
+
+AdrType_t firstMismatch(const unsigned char *a, const unsigned char *b, AdrType_t len)
+{
+#if defined(DDRESCUECMP_X86_DISPATCH)
+    typedef AdrType_t (*Kernel_t)(const unsigned char *, const unsigned char *, AdrType_t);
+    static const Kernel_t kernel = __builtin_cpu_supports("avx2") ? firstMismatchAvx2 :
+        (__builtin_cpu_supports("sse2") ? firstMismatchSse2 : firstMismatchPortable);
+    return kernel(a, b, len);
+#elif defined(DDRESCUECMP_SSE2)
+    return firstMismatchSse2(a, b, len);
+#elif defined(DDRESCUECMP_NEON)
+    return firstMismatchNeon(a, b, len);
+#else
+    return firstMismatchPortable(a, b, len);
+#endif
+}
+
+// split the address space into ranges by which images rescued them
+CoverageList_t findCoverage(const std::vector<ExtentSet> &maps)
+{
+    CoverageList_t res;
+    if (maps.size() == 1)
+    {
+        for (ExtentSet::const_iterator itor = maps[0].begin(); itor != maps[0].end(); itor++)
+        {
+            Coverage c = { itor->pos, itor->len, 1u };
+            res.push_back(c);
+        }
+        return res;
+    }
+    struct Edge {
+        AdrType_t pos;
+        unsigned image;
+        bool start;
+        bool operator < (const Edge &other) const
+        {   // at the same address, ends go first
+            return (pos != other.pos) ? (pos < other.pos) : (start < other.start);
+        }
+    };
+    std::vector<Edge> edges;
+    for (unsigned i = 0; i < maps.size(); i++)
+        for (ExtentSet::const_iterator itor = maps[i].begin(); itor != maps[i].end(); itor++)
+        {
+            Edge first = { itor->pos, i, true };
+            Edge last = { itor->pos + itor->len, i, false };
+            edges.push_back(first);
+            edges.push_back(last);
+        }
+    std::sort(edges.begin(), edges.end());
+    unsigned images = 0;
+    for (size_t k = 0; k < edges.size(); )
+    {
+        AdrType_t pos = edges[k].pos;
+        for (; (k < edges.size()) && (edges[k].pos == pos); k++)
+        {
+            if (edges[k].start)
+                images |= 1u << edges[k].image;
+            else
+                images &= ~(1u << edges[k].image);
+        }
+        if (images && (k < edges.size()))
+        {
+            Coverage c = { pos, edges[k].pos - pos, images };
+            res.push_back(c);
+        }
+    }
+    return res;
+}
+
+unsigned countImages(unsigned images)
+{
+    unsigned count = 0;
+    for (; images; images &= images - 1)
+        count++;
+    return count;
+}
+
+// compare [begin, end) of the images whose bits are set in images.
+// returns the address of the first byte where any of them differs from the first, or end.
+// With bad, the whole range is compared and every differing sector is added to bad instead.
+// bufs must have room for bufSize bytes per image.
+AdrType_t compareImages(ImageList_t &isos, unsigned images, AdrType_t begin, AdrType_t end,
+    char *bufs, AdrType_t bufSize, ExtentSet *bad, AdrType_t sectorSize)
+{
+    const unsigned char *data[MAX_IMAGES];
+    unsigned count = 0;
+    for (unsigned i = 0; i < isos.size(); i++)
+        if (images & (1u << i))
+        {
+            if (!(data[count++] = isos[i].map(begin, end - begin)))
+                break;
+        }
+    if (data[count - 1] && (count == countImages(images)))
+    {   // all mapped
+        AdrType_t i = compareChunk(data, count, end - begin, begin, bad, sectorSize);
+        return begin + i;
+    }
+
+    while (end > begin)
+    {
+        AdrType_t readLen = std::min(bufSize, end - begin);
+        count = 0;
+        for (unsigned i = 0; i < isos.size(); i++)
+        {
+            if (!(images & (1u << i)))
+                continue;
+            const unsigned char *p = isos[i].map(begin, readLen);
+            if (!p)
+            {
+                char *buf = bufs + i * bufSize;
+                if (!isos[i].read(begin, buf, readLen))
+                    throw std::runtime_error( "oops cannot read " + isos[i].name());
+                p = reinterpret_cast<const unsigned char *>(buf);
+            }
+            data[count++] = p;
+        }
+        AdrType_t i = compareChunk(data, count, readLen, begin, bad, sectorSize);
+        if (i != readLen)
+            return begin + i;
+        begin += readLen;
+    }
+    return end;
+}
+
+// compare count buffers of len bytes against data[0]. pos is the image address of the buffers.
+// returns the offset of the first byte at which any of them differs, or len.
+// With bad, every differing sector is added to bad instead, and len is returned.
+AdrType_t compareChunk(const unsigned char * const *data, unsigned count, AdrType_t len, AdrType_t pos,
+    ExtentSet *bad, AdrType_t sectorSize)
+{
+    if (!bad)
+    {
+        AdrType_t first = len;
+        for (unsigned i = 1; i < count; i++)
+            first = firstMismatch(data[0], data[i], first);  // only what's before the earliest so far
+        return first;
+    }
+    if (count == 2)
+    {
+        diffBlocks(data[0], data[1], len, pos, *bad, sectorSize);
+        return len;
+    }
+    ExtentSet chunkBad;
+    for (unsigned i = 1; i < count; i++)
+    {
+        ExtentSet pairBad;
+        diffBlocks(data[0], data[i], len, pos, pairBad, sectorSize);
+        if (!pairBad.empty())
+            chunkBad = ExtentSet::unite(chunkBad, pairBad);
+    }
+    for (ExtentSet::const_iterator itor = chunkBad.begin(); itor != chunkBad.end(); itor++)
+        bad->extend(itor->pos, itor->len);
+    return len;
+}
+
+// add to bad every sector in which a and b differ. pos is the image address of a[0].
+// The vector compare finds a difference, and the scan resumes at the next sector.
+template <unsigned N>
+static void diffSectors(const unsigned char *a, const unsigned char *b, AdrType_t len, AdrType_t pos,
+    ExtentSet &bad, AdrType_t sectorSize)
+{
+    const AdrType_t sector = kernelSectorSize<N>(sectorSize);
+    AdrType_t i = 0;
+    while (i < len)
+    {
+        i += firstMismatch(a + i, b + i, len - i);
+        if (i >= len)
+            break;
+        AdrType_t block = pos + i - (pos + i) % sector;
+        bad.extend(block, sector);
+        i = block + sector - pos;
+    }
+}
+
+void diffBlocks(const unsigned char *a, const unsigned char *b, AdrType_t len, AdrType_t pos,
+    ExtentSet &bad, AdrType_t sectorSize)
+{
+    sectorKernel(sectorSize, SECTOR_KERNELS(diffSectors))(a, b, len, pos, bad, sectorSize);
+}
+
+// append to a mapfile's entries, joining a range to the one before if it has the same status
+static void addMapEntry(MapEntryList_t &entries, AdrType_t pos, AdrType_t len, char status)
+{
+    if (!entries.empty())
+    {
+        MapEntry &last = entries.back();
+        if ((last.status == status) && (last.pos + last.len == pos))
+        {
+            last.len += len;
+            return;
+        }
+    }
+    MapEntry e = { pos, len, status };
+    entries.push_back(e);
+}
+
+// write a ddrescue mapfile covering [0, size). marked gets status mark and everything else other.
+void writeMapfile(const std::string &name, const ExtentSet &marked, char mark, char other, AdrType_t size)
+{
+    MapEntryList_t entries;
+    for (ExtentSet::const_iterator itor = marked.begin(); itor != marked.end(); itor++)
+        addMapEntry(entries, itor->pos, itor->len, mark);
+    writeMapfile(name, entries, other, size);
+}
+
+// write a ddrescue mapfile covering [0, size) from entries in address order. Gaps get status other.
+void writeMapfile(const std::string &name, const MapEntryList_t &entries, char other, AdrType_t size)
+{
+    std::ofstream ofs(name.c_str());
+    if (!ofs.is_open())
+        throw std::runtime_error(std::string("Could not open ") + name);
+    if (!entries.empty())
+        size = std::max(size, entries.back().pos + entries.back().len);
+    ofs << "# Mapfile. Created by ddrescuecmp" << std::endl
+        << "# current_pos  current_status  current_pass" << std::endl
+        << "0x00000000     " << other << "               1" << std::endl
+        << "#      pos        size  status" << std::endl
+        << std::hex << std::uppercase << std::setfill('0');
+    AdrType_t pos = 0;
+    for (MapEntryList_t::const_iterator itor = entries.begin(); itor != entries.end(); itor++)
+    {
+        if (itor->pos > pos)
+            ofs << "0x" << std::setw(8) << pos << "  0x" << std::setw(8) << (itor->pos - pos) << 
+                "  " << other << std::endl;
+        ofs << "0x" << std::setw(8) << itor->pos << "  0x" << std::setw(8) << itor->len << 
+            "  " << itor->status << std::endl;
+        pos = itor->pos + itor->len;
+    }
+    if (size > pos)
+        ofs << "0x" << std::setw(8) << pos << "  0x" << std::setw(8) << (size - pos) << 
+            "  " << other << std::endl;
+    if (!ofs)
+        throw std::runtime_error(std::string("Failed to write ") + name);
+}
+
+/* Build mergeName.iso and mergeName.log from all the images in one pass over each.
+** A range only one image rescued is copied from that image file to file, without passing
+** through our buffers when the kernel can do it. Where several did, each
+** CDROM block is taken from the majority of them. A block with no majority is left
+** unwritten and is bad-sector in the new mapfile. Every block on which the images
+** disagreed is added to badBlocks. */
+void mergeImages(std::ostream &report, RunStats &stats, ImageList_t &isos, const CoverageList_t &coverage,
+    AdrType_t bufSize, AdrType_t sectorSize, const std::string &mergeName, ExtentSet &badBlocks)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ImageWriter out;
+    if (!out.open(mergeName + ".iso"))
+        throw std::runtime_error(std::string("Could not open ") + mergeName + ".iso");
+
+    // the readers only see the ranges that need a vote
+    std::vector<ExtentList_t> perImage(isos.size());
+    for (CoverageList_t::const_iterator itor = coverage.begin(); itor != coverage.end(); itor++)
+        if (countImages(itor->images) > 1)
+            for (unsigned i = 0; i < isos.size(); i++)
+                if (itor->images & (1u << i))
+                    perImage[i].push_back(Extent(itor->pos, itor->len));
+    std::vector<std::unique_ptr<ExtentReader> > readers;
+    for (unsigned i = 0; i < isos.size(); i++)
+        readers.push_back(std::unique_ptr<ExtentReader>(new ExtentReader(isos[i], perImage[i], bufSize)));
+
+    MapEntryList_t entries;
+    AlignedBuffer copyBuf;
+    std::vector<AdrType_t> bytesOnlyIn(isos.size());
+    AdrType_t bytesReflinked = 0;
+    AdrType_t bytesMerged = 0;
+    AdrType_t blocksOutvoted = 0;
+    AdrType_t blocksUnresolved = 0;
+    const unsigned char *data[MAX_IMAGES];
+    for (CoverageList_t::const_iterator itor = coverage.begin(); itor != coverage.end(); itor++)
+    {
+        if (countImages(itor->images) == 1)
+        {
+            unsigned i = 0;
+            while (!(itor->images & (1u << i)))
+                i++;
+            AdrType_t reflinked = 0;
+            if (copyBuf.empty())
+                copyBuf.resize(static_cast<size_t>(bufSize));
+            if (!out.copyFrom(isos[i], itor->pos, itor->pos, itor->len, &copyBuf[0], bufSize, reflinked))
+                throw std::runtime_error( "oops cannot copy " + isos[i].name() + " to " + out.name());
+            addMapEntry(entries, itor->pos, itor->len, '+');
+            bytesOnlyIn[i] += itor->len;
+            bytesReflinked += reflinked;
+            bytesMerged += itor->len;
+            stats.advance(itor->len);
+            continue;
+        }
+        const AdrType_t end = itor->pos + itor->len;
+        for (AdrType_t pos = itor->pos; pos < end; pos += bufSize)
+        {
+            unsigned count = 0;
+            for (unsigned i = 0; i < isos.size(); i++)
+            {
+                if (!(itor->images & (1u << i)))
+                    continue;
+                ExtentReader::Chunk c;
+                if (!readers[i]->next(c) || !c.data)
+                    throw std::runtime_error( "oops cannot read " + isos[i].name());
+                data[count++] = c.data;
+            }
+            const AdrType_t len = std::min(bufSize, end - pos);
+            stats.advance(len);
+            if (compareChunk(data, count, len, pos, 0) == len)
+            {
+                if (!out.write(pos, data[0], len))
+                    throw std::runtime_error(std::string("Failed to write ") + out.name());
+                addMapEntry(entries, pos, len, '+');
+                bytesMerged += len;
+                continue;
+            }
+            // they disagree somewhere in this chunk. Vote on it a block at a time.
+            for (AdrType_t p = pos; p < pos + len; )
+            {
+                const AdrType_t blockStart = p - p % sectorSize;
+                const AdrType_t n = std::min(pos + len, blockStart + sectorSize) - p;
+                const AdrType_t off = p - pos;
+                unsigned winner = 0;
+                unsigned mostVotes = 0;
+                for (unsigned a = 0; a < count; a++)
+                {
+                    unsigned votes = 0;
+                    for (unsigned b = 0; b < count; b++)
+                        if ((a == b) || (memcmp(data[a] + off, data[b] + off, static_cast<size_t>(n)) == 0))
+                            votes++;
+                    if (votes > mostVotes)
+                    {
+                        mostVotes = votes;
+                        winner = a;
+                    }
+                }
+                if (mostVotes < count)
+                    badBlocks.extend(blockStart, sectorSize);
+                if (2 * mostVotes > count)
+                {
+                    if (!out.write(p, data[winner] + off, n))
+                        throw std::runtime_error(std::string("Failed to write ") + out.name());
+                    addMapEntry(entries, p, n, '+');
+                    bytesMerged += n;
+                    if ((mostVotes < count) && (p == blockStart))
+                        blocksOutvoted++;
+                }
+                else
+                {
+                    addMapEntry(entries, p, n, '-');
+                    if (p == blockStart)
+                        blocksUnresolved++;
+                }
+                p += n;
+            }
+        }
+    }
+
+    AdrType_t size = 0;
+    for (size_t i = 0; i < isos.size(); i++)
+        size = std::max(size, isos[i].size());
+    if (!out.setSize(size))
+        throw std::runtime_error(std::string("Failed to write ") + out.name());
+    writeMapfile(mergeName + ".log", entries, '?', size);
+    for (size_t i = 0; i < isos.size(); i++)
+        report << "Rescued only in " << isos[i].name() << ": " << std::dec << bytesOnlyIn[i] << " bytes" << std::endl;
+    if (bytesReflinked)
+        report << "Shared by reflink: " << bytesReflinked << " bytes" << std::endl;
+    report << "Blocks decided by majority: " << std::dec << blocksOutvoted << 
+        ", blocks with no majority: " << blocksUnresolved << std::endl;
+    reportRate(report, "Merged", bytesMerged, start);
+}
+
+/* Write name, a -gz image of iso with the frames that have any of kept in them (see GzFrame).
+** The frames are read and deflated a batch at a time on the pool, and written in address order. */
+void writeCompressed(std::ostream &report, RunStats &stats, WorkPool &pool, ImageFile &iso,
+    const ExtentSet &kept, const std::string &name)
+{
+#if defined(DDRESCUECMP_ZLIB)
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ImageWriter out;
+    if (!out.open(name))
+        throw std::runtime_error(std::string("Could not open ") + name);
+
+    const AdrType_t size = iso.size();
+    std::vector<AdrType_t> frames;
+    for (ExtentSet::const_iterator itor = kept.begin(); itor != kept.end(); itor++)
+    {
+        const AdrType_t end = std::min(itor->pos + itor->len, size);
+        for (AdrType_t pos = itor->pos / GZ_FRAME_SIZE * GZ_FRAME_SIZE; pos < end; pos += GZ_FRAME_SIZE)
+            if (frames.empty() || (frames.back() < pos))
+                frames.push_back(pos);
+    }
+    stats.expect(frames.size() * GZ_FRAME_SIZE);
+
+    const size_t batch = pool.threads() * 4;
+    AlignedBuffer workerBufs(static_cast<size_t>(pool.threads() * GZ_FRAME_SIZE));
+    std::vector<std::vector<unsigned char> > packed(batch);
+    std::vector<GzFrame> index;
+    AdrType_t offset = 0;
+    AdrType_t bytesIn = 0;
+    for (size_t first = 0; first < frames.size(); first += batch)
+    {
+        const size_t count = std::min(batch, frames.size() - first);
+        pool.run(count, [&](size_t k, unsigned worker)
+        {
+            const AdrType_t pos = frames[first + k];
+            const AdrType_t len = std::min(GZ_FRAME_SIZE, size - pos);
+            const unsigned char *p = iso.map(pos, len);
+            if (!p)
+            {
+                char *buf = &workerBufs[static_cast<size_t>(GZ_FRAME_SIZE * worker)];
+                if (!iso.read(pos, buf, len))
+                    throw std::runtime_error("oops cannot read " + iso.name());
+                p = reinterpret_cast<const unsigned char *>(buf);
+            }
+            if (!deflateMember(p, len, packed[k]))
+                throw std::runtime_error("Failed to compress " + iso.name());
+            stats.advance(len);
+        });
+        for (size_t k = 0; k < count; k++)
+        {
+            const GzFrame f = { frames[first + k], offset, packed[k].size() };
+            if (!out.write(offset, &packed[k][0], f.length))
+                throw std::runtime_error(std::string("Failed to write ") + name);
+            index.push_back(f);
+            offset += f.length;
+            bytesIn += std::min(GZ_FRAME_SIZE, size - f.pos);
+        }
+    }
+
+    // the index, and the trailer that says where it is
+    std::vector<unsigned char> table(index.size() * GZ_INDEX_ENTRY + 1);
+    for (size_t i = 0; i < index.size(); i++)
+    {
+        putGzLe64(&table[i * GZ_INDEX_ENTRY], index[i].pos);
+        putGzLe64(&table[i * GZ_INDEX_ENTRY + 8], index[i].offset);
+        putGzLe64(&table[i * GZ_INDEX_ENTRY + 16], index[i].length);
+    }
+    std::vector<unsigned char> packedIndex;
+    if (!deflateMember(&table[0], index.size() * GZ_INDEX_ENTRY, packedIndex))
+        throw std::runtime_error("Failed to compress the index of " + name);
+    unsigned char trailer[GZ_TRAILER_SIZE];
+    memcpy(trailer, GZ_TRAILER_HEAD, sizeof(GZ_TRAILER_HEAD));
+    unsigned char *n = trailer + sizeof(GZ_TRAILER_HEAD);
+    putGzLe64(n, offset);
+    putGzLe64(n + 8, packedIndex.size());
+    putGzLe64(n + 16, size);
+    putGzLe64(n + 24, GZ_FRAME_SIZE);
+    putGzLe64(n + 32, index.size());
+    memcpy(n + 40, GZ_TRAILER_TAIL, sizeof(GZ_TRAILER_TAIL));
+    if (!out.write(offset, &packedIndex[0], packedIndex.size()) ||
+        !out.write(offset + packedIndex.size(), trailer, GZ_TRAILER_SIZE))
+        throw std::runtime_error(std::string("Failed to write ") + name);
+
+    const AdrType_t fileSize = offset + packedIndex.size() + GZ_TRAILER_SIZE;
+    std::ostringstream percent;
+    percent << std::fixed << std::setprecision(1) << (bytesIn ? 100.0 * fileSize / bytesIn : 0.0);
+    report << "Frames stored in " << name << ": " << std::dec << index.size() << " of " <<
+        (size + GZ_FRAME_SIZE - 1) / GZ_FRAME_SIZE << ", " << bytesIn << " bytes in " << fileSize <<
+        " (" << percent.str() << "%)" << std::endl;
+    reportRate(report, "Compressed", bytesIn, start);
+#else
+    (void)report;
+    (void)stats;
+    (void)pool;
+    (void)iso;
+    (void)kept;
+    throw std::runtime_error("Can't write " + name + ": this ddrescuecmp was built without zlib");
+#endif
+}
+
+ImageWriter::ImageWriter()
+#if defined(DDRESCUECMP_POSIX)
+    : m_fd(-1)
+#endif
+{}
+
+ImageWriter::~ImageWriter()
+{
+#if defined(DDRESCUECMP_POSIX)
+    if (m_fd >= 0)
+        ::close(m_fd);
+#endif
+}
+
+bool ImageWriter::open(const std::string &name)
+{
+    m_name = name;
+#if defined(DDRESCUECMP_POSIX)
+    m_fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    return m_fd >= 0;
+#else
+    m_stream.open(name.c_str(), std::ofstream::binary | std::ofstream::trunc);
+    return m_stream.is_open();
+#endif
+}
+
+bool ImageWriter::write(AdrType_t pos, const void *data, AdrType_t len)
+{
+    const char *p = static_cast<const char *>(data);
+#if defined(DDRESCUECMP_POSIX)
+    while (len > 0)
+    {
+        ssize_t c = ::pwrite(m_fd, p, static_cast<size_t>(len), static_cast<off_t>(pos));
+        if (c <= 0)
+            return false;
+        p += c;
+        pos += c;
+        len -= c;
+    }
+    return true;
+#else
+    m_stream.seekp(pos);
+    m_stream.write(p, len);
+    return !m_stream.fail();
+#endif
+}
+
+bool ImageWriter::copyFrom(ImageFile &src, AdrType_t srcPos, AdrType_t destPos, AdrType_t len, char *buf,
+    AdrType_t bufSize, AdrType_t &reflinked)
+{
+    reflinked = 0;
+#if defined(DDRESCUECMP_LINUX)
+    const AdrType_t copyPos = srcPos;
+    const AdrType_t copyLen = len;
+    // the file of a -gz image doesn't hold the bytes as they are. Those go through the buffer.
+    const bool byKernel = !src.compressed();
+    {   // A reflink shares the blocks instead of copying them, but only whole filesystem blocks.
+        // A partial block at the end gets copied below.
+        struct stat st;
+        if (byKernel && (::fstat(m_fd, &st) == 0) && (st.st_blksize > 0) &&
+            (srcPos % st.st_blksize == 0) && (destPos % st.st_blksize == 0) && (len >= static_cast<AdrType_t>(st.st_blksize)))
+        {
+            struct file_clone_range range;
+            range.src_fd = src.fd();
+            range.src_offset = srcPos;
+            range.src_length = len / st.st_blksize * st.st_blksize;
+            range.dest_offset = destPos;
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            const bool shared = (::ioctl(m_fd, FICLONERANGE, &range) == 0);
+            if (src.counters())
+                src.counters()->count(1, shared ? range.src_length : 0, start);
+            if (shared)
+            {
+                reflinked = range.src_length;
+                srcPos += reflinked;
+                destPos += reflinked;
+                len -= reflinked;
+            }
+        }
+    }
+    bool useSendfile = false;
+    while (byKernel && (len > 0))
+    {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ssize_t c = -1;
+        if (!useSendfile)
+        {
+            loff_t in = static_cast<loff_t>(srcPos);
+            loff_t out = static_cast<loff_t>(destPos);
+            c = ::copy_file_range(src.fd(), &in, m_fd, &out, static_cast<size_t>(len), 0);
+            if ((c < 0) && ((errno == ENOSYS) || (errno == EXDEV) || (errno == EINVAL) || (errno == EOPNOTSUPP)))
+                useSendfile = true;
+        }
+        if (useSendfile)
+        {
+            off_t in = static_cast<off_t>(srcPos);
+            if (::lseek(m_fd, static_cast<off_t>(destPos), SEEK_SET) < 0)
+                break;
+            c = ::sendfile(m_fd, src.fd(), &in, static_cast<size_t>(len));
+        }
+        if (src.counters())
+            src.counters()->count(1, (c > 0) ? c : 0, start);
+        if (c <= 0)
+            break;
+        srcPos += c;
+        destPos += c;
+        len -= c;
+    }
+    src.doneWith(copyPos, copyLen - len);
+    if (len == 0)
+        return true;
+#endif
+    // through our own buffer, or straight from the source's map
+    while (len > 0)
+    {
+        AdrType_t n = std::min(len, bufSize);
+        const unsigned char *p = src.map(srcPos, n);
+        if (!p)
+        {
+            if (!src.read(srcPos, buf, n))
+                return false;
+            p = reinterpret_cast<const unsigned char *>(buf);
+        }
+        if (!write(destPos, p, n))
+            return false;
+        srcPos += n;
+        destPos += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool ImageWriter::punchHole(AdrType_t pos, AdrType_t len)
+{
+#if defined(DDRESCUECMP_LINUX) && defined(FALLOC_FL_PUNCH_HOLE)
+    return ::fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+        static_cast<off_t>(pos), static_cast<off_t>(len)) == 0;
+#else
+    (void)pos;
+    (void)len;
+    return false;
+#endif
+}
+
+bool ImageWriter::setSize(AdrType_t size)
+{
+#if defined(DDRESCUECMP_POSIX)
+    return ::ftruncate(m_fd, static_cast<off_t>(size)) == 0;
+#else
+    m_stream.seekp(0, std::ios::end);
+    if ((size > 0) && (static_cast<AdrType_t>(m_stream.tellp()) < size))
+    {
+        m_stream.seekp(size - 1);
+        m_stream.put(0);
+    }
+    return !m_stream.fail();
+#endif
+}
+
+ExtentReader::ExtentReader(ImageFile &image, const ExtentList_t &extents, AdrType_t chunkSize,
+    unsigned depth, unsigned ioThreads)
+    : m_image(image), m_next(0), m_issued(0), m_started(false), m_stop(false)
+{
+    for (size_t e = 0; e < extents.size(); e++)
+    {
+        AdrType_t end = extents[e].pos + extents[e].len;
+        for (AdrType_t pos = extents[e].pos; pos < end; pos += chunkSize)
+        {
+            Chunk c = { e, pos, std::min(chunkSize, end - pos), 0 };
+            m_chunks.push_back(c);
+        }
+    }
+    if (m_chunks.empty() || m_image.map(0, m_image.size()))
+        return; // nothing to read, or the chunks come from the map
+    m_slots.resize(std::max(depth, 2u));
+    m_bufs.resize(static_cast<size_t>(chunkSize) * m_slots.size());
+    for (size_t i = 0; i < m_slots.size(); i++)
+    {
+        m_slots[i].buf = &m_bufs[static_cast<size_t>(chunkSize) * i];
+        m_slots[i].filled = NO_CHUNK;
+        m_slots[i].ok = false;
+    }
+    for (unsigned i = 0; i < std::max(ioThreads, 1u); i++)
+        m_threads.push_back(std::thread(&ExtentReader::readAhead, this));
+}
+
+ExtentReader::~ExtentReader()
+{
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        m_stop = true;
+    }
+    m_slotFree.notify_all();
+    for (size_t i = 0; i < m_threads.size(); i++)
+        m_threads[i].join();
+}
+
+void ExtentReader::readAhead()
+{
+    for (;;)
+    {
+        size_t idx;
+        {
+            std::unique_lock<std::mutex> g(m_lock);
+            while (!m_stop && (m_issued < m_chunks.size()) && (m_issued >= m_next + m_slots.size()))
+                m_slotFree.wait(g);
+            if (m_stop || (m_issued >= m_chunks.size()))
+                return;
+            idx = m_issued++;
+        }
+        Slot &slot = m_slots[idx % m_slots.size()];
+        bool ok = m_image.read(m_chunks[idx].pos, slot.buf, m_chunks[idx].len);
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            slot.ok = ok;
+            slot.filled = idx;
+        }
+        m_slotFilled.notify_all();
+    }
+}
+
+bool ExtentReader::next(Chunk &chunk)
+{
+    if (m_slots.empty())
+    {   // mapped, or nothing to do
+        if (m_started)
+            m_next++;
+        m_started = true;
+        if (m_next >= m_chunks.size())
+            return false;
+        chunk = m_chunks[m_next];
+        chunk.data = m_image.map(chunk.pos, chunk.len);
+#if defined(DDRESCUECMP_POSIX)
+        static const size_t AHEAD = 4;
+        if (m_next + AHEAD < m_chunks.size())
+        {   // madvise wants a page aligned address
+            const Chunk &ahead = m_chunks[m_next + AHEAD];
+            const unsigned char *p = m_image.map(ahead.pos, ahead.len);
+            if (p)
+            {
+                uintptr_t page = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+                uintptr_t a = reinterpret_cast<uintptr_t>(p) & ~(page - 1);
+                ::madvise(reinterpret_cast<void *>(a),
+                    static_cast<size_t>(reinterpret_cast<uintptr_t>(p) + ahead.len - a), MADV_WILLNEED);
+            }
+        }
+#endif
+        return true;
+    }
+
+    std::unique_lock<std::mutex> g(m_lock);
+    if (m_started)
+    {   // the consumer is done with the previous chunk. Its slot can be refilled.
+        m_next++;
+        m_slotFree.notify_all();
+    }
+    m_started = true;
+    if (m_next >= m_chunks.size())
+        return false;
+    Slot &slot = m_slots[m_next % m_slots.size()];
+    if (slot.filled != m_next)
+    {   // the read ahead hasn't kept up
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while (slot.filled != m_next)
+            m_slotFilled.wait(g);
+        if (m_image.counters())
+            m_image.counters()->waitNanos += static_cast<AdrType_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+    }
+    chunk = m_chunks[m_next];
+    chunk.data = slot.ok ? reinterpret_cast<const unsigned char *>(slot.buf) : 0;
+    return true;
+}
+
+LogWatcher::LogWatcher(const std::vector<std::string> &names) : m_names(names)
+#if defined(DDRESCUECMP_LINUX)
+    , m_fd(-1)
+#endif
+{
+#if defined(DDRESCUECMP_LINUX)
+    m_fd = ::inotify_init1(IN_CLOEXEC);
+    for (size_t i = 0; (m_fd >= 0) && (i < names.size()); i++)
+    {
+        std::string::size_type slash = names[i].rfind('/');
+        std::string dir = (slash == names[i].npos) ? std::string(".") : names[i].substr(0, slash + 1);
+        m_leaves.push_back((slash == names[i].npos) ? names[i] : names[i].substr(slash + 1));
+        // the same directory twice gets the same watch back
+        int wd = ::inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0)
+        {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+        m_watches.push_back(wd);
+    }
+#endif
+#if defined(DDRESCUECMP_POSIX)
+    changed();
+#endif
+}
+
+LogWatcher::~LogWatcher()
+{
+#if defined(DDRESCUECMP_LINUX)
+    if (m_fd >= 0)
+        ::close(m_fd);
+#endif
+}
+
+void LogWatcher::wait()
+{
+#if defined(DDRESCUECMP_LINUX)
+    while (m_fd >= 0)
+    {
+        alignas(struct inotify_event) char buf[4096];
+        ssize_t n = ::read(m_fd, buf, sizeof(buf));
+        if ((n < 0) && (errno == EINTR))
+            continue;
+        if (n <= 0)
+        {   // give up on inotify and poll
+            ::close(m_fd);
+            m_fd = -1;
+            break;
+        }
+        bool hit = false;
+        for (const char *p = buf; p < buf + n; )
+        {
+            const struct inotify_event *ev = reinterpret_cast<const struct inotify_event *>(p);
+            for (size_t i = 0; ev->len && (i < m_leaves.size()); i++)
+                if ((ev->wd == m_watches[i]) && (m_leaves[i] == ev->name))
+                    hit = true;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        if (hit)
+        {
+            changed();
+            return;
+        }
+    }
+#endif
+#if defined(DDRESCUECMP_POSIX)
+    while (!changed())
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+#else
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+#endif
+}
+
+#if defined(DDRESCUECMP_POSIX)
+bool LogWatcher::changed()
+{
+    bool any = false;
+    m_stamps.resize(m_names.size());
+    for (size_t i = 0; i < m_names.size(); i++)
+    {
+        struct stat st;
+        std::pair<AdrType_t, AdrType_t> now(0, 0);
+        if (::stat(m_names[i].c_str(), &st) == 0)
+            now = std::make_pair(static_cast<AdrType_t>(st.st_mtime), static_cast<AdrType_t>(st.st_size));
+        if (now != m_stamps[i])
+            any = true;
+        m_stamps[i] = now;
+    }
+    return any;
+}
+#endif
+
+/* A raw CD sector is
+**      12 bytes    sync: 00, ten FF, 00
+**      4 bytes     header: address, then the mode
+**  Mode 1:
+**      2048 bytes  data
+**      4 bytes     EDC of everything before it
+**      8 bytes     zero
+**      172 bytes   P parity, 104 bytes Q parity (together the ECC)
+**  Mode 2 (XA):
+**      8 bytes     subheader, 4 bytes given twice. Bit 5 of its third byte says which form.
+**      Form 1: 2048 bytes data, EDC of the subheader and data, then P and Q parity
+**              worked out as if the header were zero
+**      Form 2: 2324 bytes data, then EDC of the subheader and data, or 0 for none
+** The EDC is a CRC-32 in reflected bit order. The parity is a Reed-Solomon product code over
+** GF(2^8): P runs down 86 columns of the 2064 bytes from the header on, and Q along 52
+** diagonals of those and the P parity. */
+static const AdrType_t RAW_HEADER_END = 16;
+static const AdrType_t MODE1_EDC = 2064;
+static const AdrType_t FORM1_EDC = 2072;
+static const AdrType_t FORM2_EDC = 2348;
+static const AdrType_t RAW_P_PARITY = 2076;
+static const AdrType_t RAW_Q_PARITY = 2248;
+static const unsigned char RAW_SYNC[12] = {0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0};
+
+/* Slicing-by-8: table k gives the CRC of a byte followed by k zero bytes, so the CRC
+** takes 8 bytes per step, with the 8 lookups independent of each other. */
+struct EdcTables
+{
+    EdcTables()
+    {
+        for (unsigned i = 0; i < 256; i++)
+        {
+            unsigned edc = i;
+            for (int b = 0; b < 8; b++)
+                edc = (edc >> 1) ^ ((edc & 1) ? 0xD8018001u : 0);
+            crc[0][i] = edc;
+        }
+        for (unsigned i = 0; i < 256; i++)
+            for (int k = 1; k < 8; k++)
+                crc[k][i] = (crc[k - 1][i] >> 8) ^ crc[0][crc[k - 1][i] & 0xFF];
+    }
+    unsigned crc[8][256];
+};
+
+static unsigned rawEdc(const unsigned char *p, AdrType_t len)
+{
+    static const EdcTables tables;
+    const unsigned (&t)[8][256] = tables.crc;
+    unsigned edc = 0;
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        edc ^= p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<unsigned>(p[3]) << 24);
+        edc = t[7][edc & 0xFF] ^ t[6][(edc >> 8) & 0xFF] ^ t[5][(edc >> 16) & 0xFF] ^ t[4][edc >> 24] ^
+            t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+    }
+    for (; len; p++, len--)
+        edc = (edc >> 8) ^ t[0][(edc ^ *p) & 0xFF];
+    return edc;
+}
+
+// the little endian EDC stored at p
+static inline unsigned storedEdc(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<unsigned>(p[3]) << 24);
+}
+
+// multiplying by 2 in GF(2^8), and the inverse of x -> x ^ 2x, for the parity
+struct EccTables
+{
+    EccTables()
+    {
+        for (unsigned i = 0; i < 256; i++)
+        {
+            const unsigned j = (i << 1) ^ ((i & 0x80) ? 0x11D : 0);
+            times2[i] = static_cast<unsigned char>(j);
+            inverse[i ^ j] = static_cast<unsigned char>(i);
+        }
+    }
+    unsigned char times2[256];
+    unsigned char inverse[256];
+};
+
+/* Whether the majorCount codewords of the product code over src match the parity there.
+** Codeword m takes minorCount bytes, the first at (m / 2) * majorMult + m % 2 and each after
+** it minorInc on, wrapping around the end. The codewords are worked on side by side rather
+** than one after another, so no lookup waits on the one before it. */
+static bool rawParityMatches(const unsigned char *src, unsigned majorCount, unsigned minorCount,
+    unsigned majorMult, unsigned minorInc, const unsigned char *parity)
+{
+    static const EccTables tables;
+    const unsigned size = majorCount * minorCount;
+    unsigned index[86];
+    unsigned char a[86];
+    unsigned char b[86];
+    for (unsigned major = 0; major < majorCount; major++)
+    {
+        index[major] = (major >> 1) * majorMult + (major & 1);
+        a[major] = 0;
+        b[major] = 0;
+    }
+    for (unsigned minor = 0; minor < minorCount; minor++)
+        for (unsigned major = 0; major < majorCount; major++)
+        {
+            const unsigned char x = src[index[major]];
+            a[major] = tables.times2[a[major] ^ x];
+            b[major] ^= x;
+            index[major] += minorInc;
+            if (index[major] >= size)
+                index[major] -= size;
+        }
+    for (unsigned major = 0; major < majorCount; major++)
+    {
+        const unsigned char p = tables.inverse[tables.times2[a[major]] ^ b[major]];
+        if ((parity[major] != p) || (parity[major + majorCount] != (p ^ b[major])))
+            return false;
+    }
+    return true;
+}
+
+// the P and Q parity of the raw sector s, from its header on
+static bool rawEccMatches(const unsigned char *s)
+{
+    return rawParityMatches(s + 12, 86, 24, 2, 86, s + RAW_P_PARITY) &&
+        rawParityMatches(s + 12, 52, 43, 86, 88, s + RAW_Q_PARITY);
+}
+
+/* Check each whole raw sector in the len bytes at pos. An extent is checked from the start of
+** a sector, and ends at the end of one, so every chunk does too. */
+template <bool ECC>
+static void verifyRawSectors(const unsigned char *data, AdrType_t pos, AdrType_t len, EdcScan &scan,
+    RawSectorCheck &check, AdrType_t)
+{
+    scan.pos = pos + len;
+    for (AdrType_t i = 0; i + RAW_SECTOR_SIZE <= len; i += RAW_SECTOR_SIZE)
+    {
+        const unsigned char *s = data + i;
+        bool good = true;
+        if (memcmp(s, RAW_SYNC, sizeof(RAW_SYNC)))
+            check.unchecked++;  // audio
+        else if (s[15] == 0)
+            check.unchecked++;
+        else if (s[15] == 1)
+        {
+            good = (rawEdc(s, MODE1_EDC) == storedEdc(s + MODE1_EDC)) && (!ECC || rawEccMatches(s));
+            if (good)
+                check.mode1++;
+        }
+        else if (s[15] != 2)
+            good = false;       // no such mode
+        else if (memcmp(s + RAW_HEADER_END, s + RAW_HEADER_END + 4, 4))
+            check.unchecked++;  // formless Mode 2 has no subheader, so no form to check it by
+        else if (s[RAW_HEADER_END + 2] & 0x20)
+        {   // Form 2 has no parity, and its EDC is optional
+            const unsigned edc = storedEdc(s + FORM2_EDC);
+            if (!edc)
+                check.unchecked++;
+            else
+            {
+                good = rawEdc(s + RAW_HEADER_END, FORM2_EDC - RAW_HEADER_END) == edc;
+                if (good)
+                    check.form2++;
+            }
+        }
+        else
+        {
+            good = rawEdc(s + RAW_HEADER_END, FORM1_EDC - RAW_HEADER_END) == storedEdc(s + FORM1_EDC);
+            if (good && ECC)
+            {   // the parity of a Form 1 sector leaves out the header
+                unsigned char copy[RAW_SECTOR_SIZE];
+                memcpy(copy, s, RAW_SECTOR_SIZE);
+                memset(copy + 12, 0, 4);
+                good = rawEccMatches(copy);
+            }
+            if (good)
+                check.form1++;
+        }
+        if (!good)
+            check.bad.extend(pos + i, RAW_SECTOR_SIZE);
+    }
+}
+
+/* xxHash64 (https://github.com/Cyan4973/xxHash), used to hash the blocks of an image.
+** The four independent lanes keep a modern CPU's multipliers busy. */
+static const unsigned long long XXH_PRIME1 = 0x9E3779B185EBCA87ULL;
+static const unsigned long long XXH_PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const unsigned long long XXH_PRIME3 = 0x165667B19E3779F9ULL;
+static const unsigned long long XXH_PRIME4 = 0x85EBCA77C2B2AE63ULL;
+static const unsigned long long XXH_PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static inline unsigned long long xxhRotl(unsigned long long x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline unsigned long long xxhRead64(const unsigned char *p)
+{   // the index file is only meaningful on the same byte order anyway
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned long long xxhRound(unsigned long long acc, unsigned long long input)
+{
+    acc += input * XXH_PRIME2;
+    return xxhRotl(acc, 31) * XXH_PRIME1;
+}
+
+static inline unsigned long long xxhMerge(unsigned long long acc, unsigned long long val)
+{
+    acc ^= xxhRound(0, val);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static unsigned long long xxHash64(const unsigned char *p, size_t len)
+{
+    const unsigned char *end = p + len;
+    unsigned long long h;
+    if (len >= 32)
+    {
+        unsigned long long v1 = XXH_PRIME1 + XXH_PRIME2;
+        unsigned long long v2 = XXH_PRIME2;
+        unsigned long long v3 = 0;
+        unsigned long long v4 = 0 - XXH_PRIME1;
+        for (; p + 32 <= end; p += 32)
+        {
+            v1 = xxhRound(v1, xxhRead64(p));
+            v2 = xxhRound(v2, xxhRead64(p + 8));
+            v3 = xxhRound(v3, xxhRead64(p + 16));
+            v4 = xxhRound(v4, xxhRead64(p + 24));
+        }
+        h = xxhRotl(v1, 1) + xxhRotl(v2, 7) + xxhRotl(v3, 12) + xxhRotl(v4, 18);
+        h = xxhMerge(h, v1);
+        h = xxhMerge(h, v2);
+        h = xxhMerge(h, v3);
+        h = xxhMerge(h, v4);
+    }
+    else
+        h = XXH_PRIME5;
+    h += len;
+    for (; p + 8 <= end; p += 8)
+        h = xxhRotl(h ^ xxhRound(0, xxhRead64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    if (p + 4 <= end)
+    {
+        unsigned v;
+        memcpy(&v, p, sizeof(v));
+        h = xxhRotl(h ^ (v * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = xxhRotl(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* The index file is
+**      8 bytes     "DDRCIDX1"
+**      8 bytes     block size
+**      8 bytes     number of blocks, n
+**      n * 8 bytes the hashes
+**      n bytes     the status each block had when it was hashed, or 0
+** in the byte order of the machine that wrote it. */
+static const char HASH_INDEX_MAGIC[8] = {'D', 'D', 'R', 'C', 'I', 'D', 'X', '1'};
+
+bool HashIndex::load(const std::string &name, AdrType_t imageSize)
+{
+    const AdrType_t blocks = (imageSize + CDROM_BLOCK_SIZE - 1) / CDROM_BLOCK_SIZE;
+    m_hash.assign(static_cast<size_t>(blocks), 0);
+    m_status.assign(static_cast<size_t>(blocks), 0);
+    std::ifstream ifs(name.c_str(), std::ifstream::binary);
+    if (!ifs.is_open())
+        return false;
+    char magic[sizeof(HASH_INDEX_MAGIC)];
+    AdrType_t blockSize(0);
+    AdrType_t count(0);
+    ifs.read(magic, sizeof(magic));
+    ifs.read(reinterpret_cast<char *>(&blockSize), sizeof(blockSize));
+    ifs.read(reinterpret_cast<char *>(&count), sizeof(count));
+    if (!ifs || memcmp(magic, HASH_INDEX_MAGIC, sizeof(magic)) || (blockSize != CDROM_BLOCK_SIZE))
+        return false;
+    // the image may have grown since. What is past the old end has no hash.
+    std::vector<unsigned long long> hashes(static_cast<size_t>(count));
+    std::vector<char> status(static_cast<size_t>(count));
+    if (count)
+    {
+        ifs.read(reinterpret_cast<char *>(&hashes[0]), count * sizeof(hashes[0]));
+        ifs.read(&status[0], count);
+    }
+    if (!ifs)
+        return false;
+    count = std::min(count, blocks);
+    std::copy(hashes.begin(), hashes.begin() + static_cast<size_t>(count), m_hash.begin());
+    std::copy(status.begin(), status.begin() + static_cast<size_t>(count), m_status.begin());
+    return true;
+}
+
+void HashIndex::save(const std::string &name) const
+{
+    std::ofstream ofs(name.c_str(), std::ofstream::binary | std::ofstream::trunc);
+    if (!ofs.is_open())
+        throw std::runtime_error(std::string("Could not open ") + name);
+    AdrType_t blockSize(CDROM_BLOCK_SIZE);
+    AdrType_t count(m_hash.size());
+    ofs.write(HASH_INDEX_MAGIC, sizeof(HASH_INDEX_MAGIC));
+    ofs.write(reinterpret_cast<const char *>(&blockSize), sizeof(blockSize));
+    ofs.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    if (count)
+    {
+        ofs.write(reinterpret_cast<const char *>(&m_hash[0]), count * sizeof(m_hash[0]));
+        ofs.write(&m_status[0], count);
+    }
+    if (!ofs)
+        throw std::runtime_error(std::string("Failed to write ") + name);
+}
+
+AdrType_t HashIndex::refresh(ImageFile &iso, const MapEntryList_t &entries, const std::string &statusChars,
+    WorkPool &pool, AdrType_t bufSize)
+{
+    // what each block's status is now: only blocks wholly inside a wanted mapfile line count
+    std::vector<char> now(m_status.size(), 0);
+    for (MapEntryList_t::const_iterator itor = entries.begin(); itor != entries.end(); itor++)
+    {
+        if (statusChars.find(itor->status) == statusChars.npos)
+            continue;
+        AdrType_t first = (itor->pos + CDROM_BLOCK_SIZE - 1) / CDROM_BLOCK_SIZE;
+        AdrType_t last = std::min<AdrType_t>((itor->pos + itor->len) / CDROM_BLOCK_SIZE, now.size());
+        for (AdrType_t b = first; b < last; b++)
+            now[b] = itor->status;
+    }
+    // runs of blocks to hash, at most a buffer full each
+    const AdrType_t unitBlocks = bufSize / CDROM_BLOCK_SIZE;
+    ExtentList_t work;
+    for (AdrType_t b = 0; b < now.size(); b++)
+    {
+        if (!now[b])
+            m_status[b] = 0;
+        else if (now[b] != m_status[b])
+        {
+            if (!work.empty() && (work.back().pos + work.back().len == b) && (work.back().len < unitBlocks))
+                work.back().len++;
+            else
+                work.push_back(Extent(b, 1));
+        }
+    }
+    AlignedBuffer bufs(static_cast<size_t>(bufSize) * pool.threads());
+    pool.run(work.size(), [&](size_t i, unsigned worker)
+    {
+        const AdrType_t pos = work[i].pos * CDROM_BLOCK_SIZE;
+        const AdrType_t len = work[i].len * CDROM_BLOCK_SIZE;
+        const unsigned char *p = iso.map(pos, len);
+        if (!p)
+        {
+            char *buf = &bufs[static_cast<size_t>(bufSize) * worker];
+            if (!iso.read(pos, buf, len))
+                throw std::runtime_error( "oops cannot read " + iso.name());
+            p = reinterpret_cast<const unsigned char *>(buf);
+        }
+        for (AdrType_t b = 0; b < work[i].len; b++)
+        {
+            m_hash[work[i].pos + b] = xxHash64(p + b * CDROM_BLOCK_SIZE, CDROM_BLOCK_SIZE);
+            m_status[work[i].pos + b] = now[work[i].pos + b];
+        }
+    });
+    AdrType_t hashed = 0;
+    for (size_t i = 0; i < work.size(); i++)
+        hashed += work[i].len;
+    return hashed;
+}
+
+// print how much work a phase did and how fast
+void reportRate(std::ostream &out, const char *what, AdrType_t bytes, std::chrono::steady_clock::time_point start)
+{
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    out << what << " " << std::dec << bytes << " bytes in " << seconds << " seconds";
+    if (seconds > 0)
+        out << " (" << (bytes / seconds / 1e6) << " MB/s)";
+    out << std::endl;
+}
+
+static const char * const PHASE_NAMES[PHASE_COUNT] =
+    {"readLog", "coverage", "index", "compare", "merge", "gz", "edc", "fs", "extract", "jpg", "carve"};
+
+static long long steadyNanos(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+static double secondsBetween(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+{
+    return std::chrono::duration<double>(to - from).count();
+}
+
+// The progress line is only written to std::cerr, and it can only tell whether that is a terminal.
+RunStats::RunStats(std::ostream *progress) : m_progress(progress), m_terminal(false), m_interval(30000000000ll),
+    m_runStart(std::chrono::steady_clock::now()), m_phase(PHASE_READ_LOG), m_total(0), m_done(0),
+    m_nextPrint(std::numeric_limits<long long>::max()), m_lineLength(0)
+{
+#if defined(DDRESCUECMP_POSIX)
+    m_terminal = (progress == &std::cerr) && ::isatty(STDERR_FILENO);
+#endif
+    if (m_terminal)
+        m_interval = 1000000000ll;
+}
+
+// the CPU time and major page faults of the process so far
+void RunStats::usage(double &cpuSeconds, long &faults)
+{
+#if defined(DDRESCUECMP_POSIX)
+    struct rusage ru;
+    if (::getrusage(RUSAGE_SELF, &ru) == 0)
+    {
+        cpuSeconds = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+        faults = ru.ru_majflt;
+        return;
+    }
+#endif
+    cpuSeconds = static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+    faults = 0;
+}
+
+RunStats::Timer::Timer(RunStats &stats, Phase_t phase, AdrType_t total) : m_stats(stats), m_phase(phase),
+    m_start(std::chrono::steady_clock::now()), m_reads(stats.m_io.reads), m_readBytes(stats.m_io.readBytes),
+    m_readNanos(stats.m_io.readNanos), m_waitNanos(stats.m_io.waitNanos)
+{
+    usage(m_cpu, m_faults);
+    stats.m_phase = phase;
+    stats.m_phaseStart = m_start;
+    stats.m_total = total;
+    stats.m_done = 0;
+    stats.m_nextPrint = steadyNanos(m_start) + stats.m_interval;
+}
+
+RunStats::Timer::~Timer()
+{
+    double cpu;
+    long faults;
+    usage(cpu, faults);
+    Totals &t = m_stats.m_totals[m_phase];
+    t.passes++;
+    t.wallSeconds += secondsBetween(m_start, std::chrono::steady_clock::now());
+    t.cpuSeconds += cpu - m_cpu;
+    t.faults += faults - m_faults;
+    t.bytes += m_stats.m_done;
+    t.reads += m_stats.m_io.reads - m_reads;
+    t.readBytes += m_stats.m_io.readBytes - m_readBytes;
+    t.readNanos += m_stats.m_io.readNanos - m_readNanos;
+    t.waitNanos += m_stats.m_io.waitNanos - m_waitNanos;
+    m_stats.endProgress();
+}
+
+// Whichever thread finds a line due takes the next one by moving the time it is due on,
+// so a line is written at most once an interval however many threads are working.
+void RunStats::advance(AdrType_t bytes)
+{
+    const AdrType_t done = (m_done += bytes);
+    if (!m_progress)
+        return;
+    const long long now = steadyNanos(std::chrono::steady_clock::now());
+    long long due = m_nextPrint;
+    if ((now < due) || !m_nextPrint.compare_exchange_strong(due, now + m_interval))
+        return;
+    printProgress(done);
+}
+
+void RunStats::printProgress(AdrType_t done)
+{
+    std::lock_guard<std::mutex> g(m_printLock);
+    const double seconds = secondsBetween(m_phaseStart, std::chrono::steady_clock::now());
+    const double rate = (seconds > 0) ? done / seconds : 0;
+    const AdrType_t total = m_total;
+    std::ostringstream line;
+    line << PHASE_NAMES[m_phase] << ": " << std::fixed << std::setprecision(1) << (done / 1e6) << " MB";
+    if (total >= done)
+        line << " of " << (total / 1e6) << " MB (" << (100.0 * done / total) << "%)";
+    line << ", " << (rate / 1e6) << " MB/s";
+    if ((total > done) && (rate > 0))
+    {
+        const AdrType_t left = static_cast<AdrType_t>((total - done) / rate);
+        line << ", " << (left / 3600) << ":" << std::setfill('0') << std::setw(2) << (left / 60 % 60) <<
+            ":" << std::setw(2) << (left % 60) << " to go";
+    }
+    if (m_terminal)
+    {   // over the line before, blanking what's left of it
+        std::string text = line.str();
+        if (text.size() < m_lineLength)
+            text.append(m_lineLength - text.size(), ' ');
+        m_lineLength = text.size();
+        *m_progress << '\r' << text << std::flush;
+    }
+    else
+        *m_progress << line.str() << std::endl;
+}
+
+// a line left on the terminal is cleared, so that what the phase prints next starts clean
+void RunStats::endProgress()
+{
+    m_nextPrint = std::numeric_limits<long long>::max();
+    std::lock_guard<std::mutex> g(m_printLock);
+    if (m_lineLength)
+        *m_progress << '\r' << std::string(m_lineLength, ' ') << '\r' << std::flush;
+    m_lineLength = 0;
+}
+
+// --stats=json: a line for each phase that ran, added up over every pass
+void RunStats::writeJson(std::ostream &out) const
+{
+    double cpu;
+    long faults;
+    usage(cpu, faults);
+    std::ostringstream json;
+    json << "{\"phases\": [";
+    bool first = true;
+    for (unsigned p = 0; p < PHASE_COUNT; p++)
+    {
+        const Totals &t = m_totals[p];
+        if (!t.passes)
+            continue;
+        json << (first ? "" : ",") << std::endl << "  {\"phase\": \"" << PHASE_NAMES[p] << "\", \"passes\": " << t.passes <<
+            ", \"wall_s\": " << t.wallSeconds << ", \"cpu_s\": " << t.cpuSeconds << ", \"bytes\": " << t.bytes <<
+            ", \"mb_per_s\": " << ((t.wallSeconds > 0) ? t.bytes / t.wallSeconds / 1e6 : 0) <<
+            ", \"reads\": " << t.reads << ", \"read_bytes\": " << t.readBytes <<
+            ", \"read_s\": " << (t.readNanos / 1e9) << ", \"wait_s\": " << (t.waitNanos / 1e9) <<
+            ", \"major_faults\": " << t.faults << "}";
+        first = false;
+    }
+    json << std::endl << "], \"wall_s\": " << secondsBetween(m_runStart, std::chrono::steady_clock::now()) <<
+        ", \"cpu_s\": " << cpu << ", \"major_faults\": " << faults << "}" << std::endl;
+    out << json.str();
+}
@@ -0,0 +1,435 @@
+/* BenchCmp
+** Times ddrescuecmp on a rescue written by genrescue, and prints the results as JSON, so that
+** they can be kept per commit and compared. "make bench" writes the rescue and runs this.
+**
+**  benchcmp data [-c data2] [-x dir] [-j N] [--runs=5] [--ddrescuecmp=./ddrescuecmp] [--label=TEXT]
+**
+** The micro benchmarks call ddrescuecmp's own functions, from DdrescueCmp.cpp compiled in with
+** its main left out, on data.log, data.iso and the rest:
+**      readLog         parsing data.log
+**      coalesce        joining every line of data.log, whatever its status, into one set
+**      unite           the union of the rescued extents of data.log and data2.log
+**      findCoverage    cutting them into ranges by which images rescued them
+**      firstMismatch   the vector compare, on two copies of the first 64MB of data.iso
+**      diffBlocks      the -diff compare of data.iso with data2.iso, mapped
+**      scanJpegChunk   the -jpg scan of data.iso, mapped
+**      parseTriplets   parsing dir.txt and putting the files in address order
+** Each is called as many times as make a run of at least 50ms, and a run's time is divided by
+** that. The images are read through the page cache, which genrescue has just filled.
+**
+** The macro benchmarks run the ddrescuecmp binary and time it whole:
+**      status          ddrescuecmp data
+**      compare         ddrescuecmp data -c data2 -diff data.bench.log -j N
+**      extract         ddrescuecmp data -x dir -j N, the directory emptied before each run
+**      jpg             ddrescuecmp data -jpg data.bench.txt -j N
+**
+** Each benchmark is run --runs times, and has its best and median seconds, the bytes and items
+** (extents, files or jpegs) it got through, and for the macro ones the exit status and peak RSS.
+** -j defaults to the number of CPUs.
+*/
+
+#define DDRESCUECMP_NO_MAIN
+#include "../DdrescueCmp.cpp"
+
+#include <ctime>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// what the command line asked for
+struct BenchOptions
+{
+    BenchOptions() : threads(std::thread::hardware_concurrency()), runs(5), ddrescuecmp("./ddrescuecmp") {}
+    std::string dataName;
+    std::string cmpName;
+    std::string dirName;
+    unsigned threads;
+    unsigned runs;
+    std::string ddrescuecmp;
+    std::string label;
+};
+
+// one benchmark's line in the output
+struct BenchResult
+{
+    BenchResult() : bytes(0), items(0), maxRss(0), exitStatus(0) {}
+    std::string name;
+    std::string kind;
+    std::string command;
+    std::vector<double> seconds;   // a run each
+    AdrType_t bytes;
+    AdrType_t items;
+    long maxRss;                    // KB, for macro
+    int exitStatus;
+};
+
+static const double MIN_RUN_SECONDS = 0.05;
+static const AdrType_t MISMATCH_BYTES = 64 * 1024 * 1024;
+static volatile size_t g_sink;     // results land here, so that no call is optimized away
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// time fn: calls enough of it to make each run last MIN_RUN_SECONDS, and keep the time per call
+template <typename Fn>
+static BenchResult timeMicro(const char *name, unsigned runs, AdrType_t bytes, AdrType_t items, Fn fn)
+{
+    BenchResult res;
+    res.name = name;
+    res.kind = "micro";
+    res.bytes = bytes;
+    res.items = items;
+    unsigned calls = 1;
+    for (;;)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < calls; i++)
+            fn();
+        if ((secondsSince(start) >= MIN_RUN_SECONDS) || (calls >= (1u << 24)))
+            break;
+        calls *= 2;
+    }
+    for (unsigned r = 0; r < runs; r++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < calls; i++)
+            fn();
+        res.seconds.push_back(secondsSince(start) / calls);
+    }
+    std::cerr << name << " " << *std::min_element(res.seconds.begin(), res.seconds.end()) << " s" << std::endl;
+    return res;
+}
+
+// remove dir and the files in it. -x writes no subdirectories without -fs.
+static void removeDirectory(const std::string &dir)
+{
+    if (DIR *d = opendir(dir.c_str()))
+    {
+        while (struct dirent *e = readdir(d))
+        {
+            if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+                unlink((dir + "/" + e->d_name).c_str());
+        }
+        closedir(d);
+    }
+    rmdir(dir.c_str());
+}
+
+// run the ddrescuecmp command line args, its output thrown away, runs times
+static BenchResult timeMacro(const char *name, const BenchOptions &opts, const std::vector<std::string> &args,
+    AdrType_t bytes, const std::string &cleanDir = std::string())
+{
+    BenchResult res;
+    res.name = name;
+    res.kind = "macro";
+    res.bytes = bytes;
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>(opts.ddrescuecmp.c_str()));
+    res.command = opts.ddrescuecmp;
+    for (size_t i = 0; i < args.size(); i++)
+    {
+        argv.push_back(const_cast<char *>(args[i].c_str()));
+        res.command += " " + args[i];
+    }
+    argv.push_back(0);
+
+    for (unsigned r = 0; r < opts.runs; r++)
+    {
+        if (!cleanDir.empty())
+            removeDirectory(cleanDir);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        pid_t pid = fork();
+        if (pid < 0)
+            throw std::runtime_error("fork failed");
+        if (pid == 0)
+        {
+            int null = ::open("/dev/null", O_WRONLY);
+            dup2(null, 1);
+            dup2(null, 2);
+            execv(argv[0], &argv[0]);
+            _exit(127);
+        }
+        int status = 0;
+        struct rusage usage;
+        if (wait4(pid, &status, 0, &usage) < 0)
+            throw std::runtime_error("wait4 failed");
+        res.seconds.push_back(secondsSince(start));
+        res.maxRss = std::max(res.maxRss, usage.ru_maxrss);
+        res.exitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        if ((res.exitStatus == 127) || WIFSIGNALED(status))
+            throw std::runtime_error(res.command + " failed with status " + std::to_string(res.exitStatus));
+    }
+    std::cerr << name << " " << *std::min_element(res.seconds.begin(), res.seconds.end()) << " s" << std::endl;
+    return res;
+}
+
+static std::string jsonString(const std::string &s)
+{
+    std::string out = "\"";
+    for (size_t i = 0; i < s.size(); i++)
+    {
+        unsigned char c = static_cast<unsigned char>(s[i]);
+        if ((c == '"') || (c == '\\'))
+            out += std::string("\\") + s[i];
+        else if (c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else
+            out += s[i];
+    }
+    return out + "\"";
+}
+
+static std::string jsonNumber(double v)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.6g", v);
+    return buf;
+}
+
+static void writeJson(std::ostream &out, const BenchOptions &opts, const std::vector<BenchResult> &results,
+    AdrType_t isoBytes, AdrType_t logBytes)
+{
+    char when[32];
+    time_t now = time(0);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    out << "{" << std::endl
+        << "  \"label\": " << jsonString(opts.label) << "," << std::endl
+        << "  \"time\": " << jsonString(when) << "," << std::endl
+        << "  \"compiler\": " << jsonString(__VERSION__) << "," << std::endl
+        << "  \"threads\": " << opts.threads << "," << std::endl
+        << "  \"runs\": " << opts.runs << "," << std::endl
+        << "  \"data\": {\"name\": " << jsonString(opts.dataName) << ", \"iso_bytes\": " << isoBytes
+        << ", \"log_bytes\": " << logBytes << "}," << std::endl
+        << "  \"results\": [" << std::endl;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &r = results[i];
+        std::vector<double> sorted(r.seconds);
+        std::sort(sorted.begin(), sorted.end());
+        const double best = sorted.front();
+        const double median = (sorted[(sorted.size() - 1) / 2] + sorted[sorted.size() / 2]) / 2;
+        out << "    {\"name\": " << jsonString(r.name) << ", \"kind\": " << jsonString(r.kind)
+            << ", \"best_s\": " << jsonNumber(best) << ", \"median_s\": " << jsonNumber(median)
+            << ", \"bytes\": " << r.bytes << ", \"items\": " << r.items
+            << ", \"mb_per_s\": " << jsonNumber(best > 0 ? r.bytes / best / 1e6 : 0)
+            << ", \"items_per_s\": " << jsonNumber(best > 0 ? r.items / best : 0);
+        if (r.kind == "macro")
+            out << ", \"max_rss_kb\": " << r.maxRss << ", \"exit\": " << r.exitStatus
+                << ", \"command\": " << jsonString(r.command);
+        out << "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl << "}" << std::endl;
+}
+
+static bool parseBenchOptions(int argc, char *argv[], BenchOptions &opts)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if ((arg == "-c") && (i + 1 < argc))
+            opts.cmpName = argv[++i];
+        else if ((arg == "-x") && (i + 1 < argc))
+            opts.dirName = argv[++i];
+        else if ((arg == "-j") && (i + 1 < argc))
+        {
+            if (!(opts.threads = static_cast<unsigned>(atoi(argv[++i]))))
+                return false;
+        }
+        else if (arg.compare(0, 7, "--runs=") == 0)
+        {
+            if (!(opts.runs = static_cast<unsigned>(atoi(arg.c_str() + 7))))
+                return false;
+        }
+        else if (arg.compare(0, 14, "--ddrescuecmp=") == 0)
+            opts.ddrescuecmp = arg.substr(14);
+        else if (arg.compare(0, 8, "--label=") == 0)
+            opts.label = arg.substr(8);
+        else if (!arg.empty() && (arg[0] != '-') && opts.dataName.empty())
+            opts.dataName = arg;
+        else
+            return false;
+    }
+    if (!opts.threads)
+        opts.threads = 1;
+    return !opts.dataName.empty();
+}
+
+// the rescued extents of name.log, and every line of it
+static void loadLog(const std::string &name, ExtentSet &map, MapEntryList_t &entries, AdrType_t &logBytes)
+{
+    ImageFile log;
+    if (!log.open(name + ".log"))
+        throw std::runtime_error("Failed to open " + name + ".log");
+    std::ostream quiet(0);
+    WorkPool pool(1);
+    readLog(quiet, log, name, "+", pool, map, &entries);
+    logBytes = log.size();
+}
+
+static void openImage(ImageFile &iso, const std::string &name)
+{
+    if (!iso.open(name + ".iso") || !iso.map(0, iso.size()))
+        throw std::runtime_error("Failed to map " + name + ".iso");
+}
+
+static void runMicro(const BenchOptions &opts, std::vector<BenchResult> &results, AdrType_t &isoBytes,
+    AdrType_t &logBytes)
+{
+    ExtentSet map;
+    MapEntryList_t entries;
+    loadLog(opts.dataName, map, entries, logBytes);
+    {
+        ImageFile log;
+        log.open(opts.dataName + ".log");
+        std::ostream quiet(0);
+        WorkPool pool(1);
+        results.push_back(timeMicro("readLog", opts.runs, log.size(), entries.size(), [&]()
+        {
+            ExtentSet res;
+            readLog(quiet, log, opts.dataName, "+", pool, res);
+            g_sink = res.size();
+        }));
+    }
+    results.push_back(timeMicro("coalesce", opts.runs, 0, entries.size(), [&]()
+    {
+        ExtentSet all;
+        all.reserve(entries.size());
+        for (size_t i = 0; i < entries.size(); i++)
+            all.append(entries[i].pos, entries[i].len);
+        all.coalesce();
+        g_sink = all.size();
+    }));
+
+    ImageFile iso;
+    openImage(iso, opts.dataName);
+    isoBytes = iso.size();
+    const unsigned char *data = iso.map(0, iso.size());
+
+    if (!opts.cmpName.empty())
+    {
+        std::vector<ExtentSet> maps(2);
+        maps[0] = map;
+        MapEntryList_t cmpEntries;
+        AdrType_t cmpLogBytes;
+        loadLog(opts.cmpName, maps[1], cmpEntries, cmpLogBytes);
+        results.push_back(timeMicro("unite", opts.runs, 0, maps[0].size() + maps[1].size(), [&]()
+        {
+            g_sink = ExtentSet::unite(maps[0], maps[1]).size();
+        }));
+        results.push_back(timeMicro("findCoverage", opts.runs, 0, maps[0].size() + maps[1].size(), [&]()
+        {
+            g_sink = findCoverage(maps).size();
+        }));
+
+        ImageFile cmp;
+        openImage(cmp, opts.cmpName);
+        const AdrType_t len = std::min(iso.size(), cmp.size());
+        const unsigned char *cmpData = cmp.map(0, len);
+        results.push_back(timeMicro("diffBlocks", opts.runs, len, 0, [&]()
+        {
+            ExtentSet bad;
+            diffBlocks(data, cmpData, len, 0, bad, CDROM_BLOCK_SIZE);
+            g_sink = bad.size();
+        }));
+    }
+
+    {
+        const size_t len = static_cast<size_t>(std::min(MISMATCH_BYTES, iso.size()));
+        std::vector<unsigned char> a(data, data + len);
+        std::vector<unsigned char> b(a);
+        results.push_back(timeMicro("firstMismatch", opts.runs, len, 0, [&]()
+        {
+            if (firstMismatch(&a[0], &b[0], len) != len)
+                throw std::logic_error("firstMismatch found a difference in a copy");
+        }));
+    }
+
+    CarveHitList_t hits;
+    results.push_back(timeMicro("scanJpegChunk", opts.runs, iso.size(), 0, [&]()
+    {
+        JpegScan scan;
+        hits.clear();
+        for (AdrType_t pos = 0; pos < iso.size(); pos += BUFSIZE)
+            scanJpegChunk<CDROM_BLOCK_SIZE>(data + pos, pos, std::min(BUFSIZE, iso.size() - pos), scan, hits,
+                CDROM_BLOCK_SIZE);
+    }));
+    results.back().items = hits.size() / 2;
+
+    if (!opts.dirName.empty())
+    {
+        ImageFile listing;
+        if (!listing.open(opts.dirName + ".txt") || !listing.map(0, listing.size()))
+            throw std::runtime_error("Failed to map " + opts.dirName + ".txt");
+        const char *text = reinterpret_cast<const char *>(listing.map(0, listing.size()));
+        FileList_t files;
+        results.push_back(timeMicro("parseTriplets", opts.runs, listing.size(), 0, [&]()
+        {
+            files.clear();
+            parseTriplets(text, text + listing.size(), CDROM_BLOCK_SIZE, files);
+            sortFiles(files);
+        }));
+        results.back().items = files.size();
+    }
+}
+
+static void runMacro(const BenchOptions &opts, std::vector<BenchResult> &results, AdrType_t isoBytes)
+{
+    std::vector<std::string> args(1, opts.dataName);
+    results.push_back(timeMacro("status", opts, args, 0));
+
+    args.push_back("-j");
+    args.push_back(std::to_string(opts.threads));
+    if (!opts.cmpName.empty())
+    {
+        std::vector<std::string> cmpArgs(args);
+        cmpArgs.push_back("-c");
+        cmpArgs.push_back(opts.cmpName);
+        cmpArgs.push_back("-diff");
+        cmpArgs.push_back(opts.dataName + ".bench.log");
+        results.push_back(timeMacro("compare", opts, cmpArgs, isoBytes));
+    }
+    if (!opts.dirName.empty())
+    {
+        std::vector<std::string> extractArgs(args);
+        extractArgs.push_back("-x");
+        extractArgs.push_back(opts.dirName);
+        results.push_back(timeMacro("extract", opts, extractArgs, 0, opts.dirName));
+    }
+    std::vector<std::string> jpgArgs(args);
+    jpgArgs.push_back("-jpg");
+    jpgArgs.push_back(opts.dataName + ".bench.txt");
+    results.push_back(timeMacro("jpg", opts, jpgArgs, isoBytes));
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions opts;
+    if (!parseBenchOptions(argc, argv, opts))
+    {
+        std::cerr << "usage: benchcmp <data> [-c DATA2] [-x DIR] [-j N] [--runs=5] [--ddrescuecmp=./ddrescuecmp] [--label=TEXT]" << std::endl
+            << " times ddrescuecmp's parts and whole runs on <data>.iso and <data>.log, as written by genrescue," << std::endl
+            << " and prints the results as JSON. -c adds the compare with DATA2, and -x the extraction of DIR.txt." << std::endl;
+        return 1;
+    }
+
+    try {
+        std::vector<BenchResult> results;
+        AdrType_t isoBytes = 0;
+        AdrType_t logBytes = 0;
+        runMicro(opts, results, isoBytes, logBytes);
+        runMacro(opts, results, isoBytes);
+        writeJson(std::cout, opts, results, isoBytes, logBytes);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,393 @@
+/* GenRescue
+** Writes a synthetic ddrescue rescue, a .iso and its .log mapfile, for benchmarking ddrescuecmp.
+**
+**  genrescue out [-c out2] [-x dir] [--size=256M] [--extents=2000] [--unrescued=0.05]
+**      [--frag=4] [--mismatch=0.0001] [--jpegs=400] [--files=20000] [--sector-size=2048] [--seed=1]
+**
+** out.iso is --size bytes of pseudo-random data, and out.log a mapfile that marks --extents
+** ranges of it rescued ('+'). --unrescued is the share of the disc in the gaps between them.
+** --frag is how many mapfile lines each gap is written as, with the statuses ddrescue leaves in
+** one (bad-sector, non-scraped, non-trimmed, non-tried), so the mapfile grows as a real one does
+** after a few passes. Extents and gaps are whole sectors of random length.
+**
+** The disc holds --files files laid end to end after the first megabyte, and --jpegs of them,
+** spread evenly among the rest, are jpegs that the -jpg scan finds: JFIF headers, a few marker
+** segments, and entropy coded data with its 0xFF bytes stuffed, up to EOI.
+** -x writes dir.txt, listing every file the way isodump does, for ddrescuecmp -x dir.
+**
+** -c writes out2.iso and out2.log, another rescue of the same disc. Its mapfile has its own
+** layout, so -c compares where the two overlap, and --mismatch is the share of its sectors
+** that differ from out.iso by a byte.
+**
+** The same options and --seed always write the same files.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+typedef unsigned long long AdrType_t;
+
+static const AdrType_t SYSTEM_AREA = 1024 * 1024;  // left clear of files, as on a real disc
+static const AdrType_t WRITE_CHUNK = 4 * 1024 * 1024;
+static const AdrType_t MIN_JPEG = 512;
+
+// what the command line asked for
+struct GenOptions
+{
+    GenOptions() : size(256ull << 20), extents(2000), unrescued(0.05), frag(4), mismatch(0.0001),
+        jpegs(400), files(20000), sectorSize(2048), seed(1) {}
+    std::string outName;
+    std::string cmpName;
+    std::string dirName;
+    AdrType_t size;
+    AdrType_t extents;
+    double unrescued;
+    unsigned frag;
+    double mismatch;
+    AdrType_t jpegs;
+    AdrType_t files;
+    AdrType_t sectorSize;
+    unsigned long long seed;
+};
+
+// splitmix64: fast, and the same sequence on every platform
+class Random
+{
+public:
+    explicit Random(unsigned long long seed) : m_state(seed) {}
+    unsigned long long next()
+    {
+        unsigned long long z = (m_state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    // in [0, n)
+    AdrType_t below(AdrType_t n) { return n ? next() % n : 0; }
+    double unit() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+private:
+    unsigned long long m_state;
+};
+
+// one line of a mapfile
+struct MapLine
+{
+    AdrType_t pos;
+    AdrType_t len;
+    char status;
+};
+
+struct FileSpan
+{
+    AdrType_t pos;
+    AdrType_t len;
+    bool jpeg;
+};
+
+// a number with an optional K, M or G after it
+static bool parseSize(const char *s, AdrType_t &v)
+{
+    char *end = 0;
+    v = strtoull(s, &end, 10);
+    if (end == s)
+        return false;
+    switch (*end)
+    {
+    case 'K': case 'k': v <<= 10; end++; break;
+    case 'M': case 'm': v <<= 20; end++; break;
+    case 'G': case 'g': v <<= 30; end++; break;
+    }
+    return *end == 0;
+}
+
+static bool parseOptions(int argc, char *argv[], GenOptions &opts)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        const char *value = strchr(argv[i], '=');
+        value = value ? value + 1 : "";
+        bool ok = true;
+        if (((arg == "-c") || (arg == "-x")) && (i + 1 < argc))
+            (arg == "-c" ? opts.cmpName : opts.dirName) = argv[++i];
+        else if (arg.compare(0, 7, "--size=") == 0)
+            ok = parseSize(value, opts.size);
+        else if (arg.compare(0, 10, "--extents=") == 0)
+            ok = parseSize(value, opts.extents) && opts.extents;
+        else if (arg.compare(0, 12, "--unrescued=") == 0)
+            ok = ((opts.unrescued = atof(value)) >= 0) && (opts.unrescued < 1);
+        else if (arg.compare(0, 7, "--frag=") == 0)
+            ok = (opts.frag = static_cast<unsigned>(atoi(value))) > 0;
+        else if (arg.compare(0, 11, "--mismatch=") == 0)
+            ok = ((opts.mismatch = atof(value)) >= 0) && (opts.mismatch <= 1);
+        else if (arg.compare(0, 8, "--jpegs=") == 0)
+            ok = parseSize(value, opts.jpegs);
+        else if (arg.compare(0, 8, "--files=") == 0)
+            ok = parseSize(value, opts.files);
+        else if (arg.compare(0, 14, "--sector-size=") == 0)
+            ok = parseSize(value, opts.sectorSize) && (opts.sectorSize >= 512);
+        else if (arg.compare(0, 7, "--seed=") == 0)
+            opts.seed = strtoull(value, 0, 10);
+        else if ((arg[0] != '-') && opts.outName.empty())
+            opts.outName = arg;
+        else
+            ok = false;
+        if (!ok)
+            return false;
+    }
+    return !opts.outName.empty() && (opts.size >= SYSTEM_AREA + opts.sectorSize);
+}
+
+// split total into count parts of at least one each, of random sizes around the mean
+static std::vector<AdrType_t> randomParts(Random &rnd, AdrType_t total, AdrType_t count)
+{
+    std::vector<AdrType_t> parts;
+    count = std::min(count, total);
+    if (!count)
+        return parts;
+    std::vector<double> weights(count);
+    double sum = 0;
+    for (AdrType_t i = 0; i < count; i++)
+        sum += (weights[i] = 0.1 + rnd.unit());
+    AdrType_t given = 0;
+    for (AdrType_t i = 0; i < count; i++)
+    {
+        AdrType_t n = 1 + static_cast<AdrType_t>((total - count) * weights[i] / sum);
+        parts.push_back(n);
+        given += n;
+    }
+    // rounding down leaves a few over. They go to the parts in turn.
+    for (AdrType_t i = 0; given < total; i = (i + 1) % count, given++)
+        parts[i]++;
+    return parts;
+}
+
+// the lines of a mapfile: extents rescued, the gaps between them of frag lines each
+static std::vector<MapLine> makeLayout(const GenOptions &opts, unsigned long long seed)
+{
+    static const char GAP_STATUS[] = "-/*?";
+    Random rnd(seed);
+    const AdrType_t sectors = opts.size / opts.sectorSize;
+    const AdrType_t extents = std::min(opts.extents, sectors);
+    const AdrType_t badSectors = std::min(sectors - extents, static_cast<AdrType_t>(sectors * opts.unrescued));
+    std::vector<AdrType_t> good = randomParts(rnd, sectors - badSectors, extents);
+    std::vector<AdrType_t> bad = randomParts(rnd, badSectors, good.size());
+
+    std::vector<MapLine> lines;
+    AdrType_t sector = 0;
+    for (size_t i = 0; i < good.size(); i++)
+    {
+        MapLine line = { sector * opts.sectorSize, good[i] * opts.sectorSize, '+' };
+        lines.push_back(line);
+        sector += good[i];
+        if (i >= bad.size())
+            continue;
+        std::vector<AdrType_t> pieces = randomParts(rnd, bad[i], opts.frag);
+        for (size_t k = 0; k < pieces.size(); k++)
+        {
+            MapLine gap = { sector * opts.sectorSize, pieces[k] * opts.sectorSize, GAP_STATUS[k % 4] };
+            lines.push_back(gap);
+            sector += pieces[k];
+        }
+    }
+    // the tail of the image past the last whole sector
+    if (opts.size > sector * opts.sectorSize)
+    {
+        MapLine tail = { sector * opts.sectorSize, opts.size - sector * opts.sectorSize, '?' };
+        lines.push_back(tail);
+    }
+    return lines;
+}
+
+static void writeLog(const std::string &name, const std::vector<MapLine> &lines)
+{
+    FILE *f = fopen(name.c_str(), "w");
+    if (!f)
+        throw std::runtime_error("Failed to open " + name);
+    fprintf(f, "# Mapfile. Created by genrescue for benchmarking ddrescuecmp\n");
+    fprintf(f, "# current_pos  current_status  current_pass\n0x00000000     +               1\n");
+    fprintf(f, "#      pos        size  status\n");
+    for (size_t i = 0; i < lines.size(); i++)
+        fprintf(f, "0x%08llX  0x%08llX  %c\n", lines[i].pos, lines[i].len, lines[i].status);
+    if (fclose(f))
+        throw std::runtime_error("Failed to write " + name);
+}
+
+// files laid end to end from the end of the system area, each starting on a sector
+static std::vector<FileSpan> makeFiles(const GenOptions &opts)
+{
+    std::vector<FileSpan> files;
+    const AdrType_t count = std::max(opts.files, opts.jpegs);
+    if (!count)
+        return files;
+    Random rnd(opts.seed * 7 + 3);
+    const AdrType_t sectors = (opts.size - SYSTEM_AREA) / opts.sectorSize;
+    std::vector<AdrType_t> spans = randomParts(rnd, sectors, count);
+    AdrType_t pos = SYSTEM_AREA;
+    for (size_t i = 0; i < spans.size(); i++)
+    {
+        // a file ends part way into its last sector
+        FileSpan f = { pos, spans[i] * opts.sectorSize - rnd.below(opts.sectorSize), false };
+        files.push_back(f);
+        pos += spans[i] * opts.sectorSize;
+    }
+    // too short a file can't hold the headers, and stays data
+    for (AdrType_t j = 0; j < opts.jpegs; j++)
+    {
+        FileSpan &f = files[j * files.size() / opts.jpegs];
+        f.jpeg = f.len >= MIN_JPEG;
+    }
+    return files;
+}
+
+/* A jpeg of exactly len bytes that the -jpg scan walks to its end: JFIF APP0, a
+** quantization table, a frame header and a scan header, then random entropy coded data with
+** each 0xFF followed by a stuffed 0x00 and the odd restart marker, then EOI. */
+static std::vector<unsigned char> makeJpeg(Random &rnd, AdrType_t len)
+{
+    static const unsigned char HEADER[] =
+    {
+        0xFF, 0xD8,
+        0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00,
+        0xFF, 0xDB, 0x00, 0x43, 0x00,
+    };
+    static const unsigned char FRAME[] =
+    {
+        0xFF, 0xC0, 0x00, 0x0B, 0x08, 0x01, 0x00, 0x01, 0x00, 0x01, 0x01, 0x11, 0x00,
+        0xFF, 0xDA, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3F, 0x00,
+    };
+    std::vector<unsigned char> jpeg(HEADER, HEADER + sizeof(HEADER));
+    for (unsigned i = 0; i < 64; i++)
+        jpeg.push_back(static_cast<unsigned char>(1 + rnd.below(64)));
+    jpeg.insert(jpeg.end(), FRAME, FRAME + sizeof(FRAME));
+    unsigned restart = 0;
+    while (jpeg.size() + 2 < len)
+    {
+        unsigned char c = static_cast<unsigned char>(rnd.next());
+        jpeg.push_back(c);
+        if ((c == 0xFF) && (jpeg.size() + 2 < len))
+            jpeg.push_back(rnd.below(16) ? 0x00 : static_cast<unsigned char>(0xD0 + restart++ % 8));
+    }
+    jpeg.resize(len - 2);
+    if (jpeg.back() == 0xFF)
+        jpeg.back() = 0x00;
+    jpeg.push_back(0xFF);
+    jpeg.push_back(0xD9);
+    return jpeg;
+}
+
+static void writeAt(FILE *f, const std::string &name, AdrType_t pos, const void *data, size_t len)
+{
+    if (fseeko(f, static_cast<off_t>(pos), SEEK_SET) || (fwrite(data, 1, len, f) != len))
+        throw std::runtime_error("Failed to write " + name);
+}
+
+// name.iso, random bytes with the jpegs in place. With a second image, a share of its sectors differ.
+static void writeImages(const GenOptions &opts, const std::vector<FileSpan> &files)
+{
+    std::vector<std::string> names(1, opts.outName + ".iso");
+    if (!opts.cmpName.empty())
+        names.push_back(opts.cmpName + ".iso");
+    std::vector<FILE *> isos;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        isos.push_back(fopen(names[i].c_str(), "w+b"));
+        if (!isos.back())
+            throw std::runtime_error("Failed to open " + names[i]);
+    }
+
+    Random rnd(opts.seed);
+    std::vector<unsigned long long> chunk(WRITE_CHUNK / sizeof(unsigned long long));
+    for (AdrType_t pos = 0; pos < opts.size; pos += WRITE_CHUNK)
+    {
+        for (size_t k = 0; k < chunk.size(); k++)
+            chunk[k] = rnd.next();
+        const size_t len = static_cast<size_t>(std::min(WRITE_CHUNK, opts.size - pos));
+        for (size_t i = 0; i < isos.size(); i++)
+            if (fwrite(&chunk[0], 1, len, isos[i]) != len)
+                throw std::runtime_error("Failed to write " + names[i]);
+    }
+
+    Random jpegRnd(opts.seed * 5 + 1);
+    for (size_t j = 0; j < files.size(); j++)
+    {
+        if (!files[j].jpeg)
+            continue;
+        std::vector<unsigned char> jpeg = makeJpeg(jpegRnd, files[j].len);
+        for (size_t i = 0; i < isos.size(); i++)
+            writeAt(isos[i], names[i], files[j].pos, &jpeg[0], jpeg.size());
+    }
+
+    if (isos.size() > 1)
+    {   // flip a byte in that many sectors, chosen at random
+        Random flipRnd(opts.seed * 3 + 2);
+        const AdrType_t sectors = opts.size / opts.sectorSize;
+        const AdrType_t flips = static_cast<AdrType_t>(sectors * opts.mismatch);
+        for (AdrType_t n = 0; n < flips; n++)
+        {
+            AdrType_t pos = flipRnd.below(sectors) * opts.sectorSize + flipRnd.below(opts.sectorSize);
+            unsigned char c = 0;
+            if (fseeko(isos[1], static_cast<off_t>(pos), SEEK_SET) || (fread(&c, 1, 1, isos[1]) != 1))
+                throw std::runtime_error("Failed to read " + names[1]);
+            c ^= 0x5A;
+            writeAt(isos[1], names[1], pos, &c, 1);
+        }
+    }
+
+    for (size_t i = 0; i < isos.size(); i++)
+        if (fclose(isos[i]))
+            throw std::runtime_error("Failed to write " + names[i]);
+}
+
+// the listing in the form isodump prints it: "[ 0 00 ] block length 00/ NAME;1"
+static void writeListing(const GenOptions &opts, const std::vector<FileSpan> &files)
+{
+    const std::string name = opts.dirName + ".txt";
+    FILE *f = fopen(name.c_str(), "w");
+    if (!f)
+        throw std::runtime_error("Failed to open " + name);
+    for (size_t i = 0; i < files.size(); i++)
+        fprintf(f, "[ 0 00 ] %llx %llu 00/ FILE%06llu.%s;1\n", files[i].pos / opts.sectorSize, files[i].len,
+            static_cast<AdrType_t>(i), files[i].jpeg ? "JPG" : "DAT");
+    if (fclose(f))
+        throw std::runtime_error("Failed to write " + name);
+}
+
+int main(int argc, char *argv[])
+{
+    GenOptions opts;
+    if (!parseOptions(argc, argv, opts))
+    {
+        std::cerr << "usage: genrescue <out> [-c OUT2] [-x DIR] [--size=256M] [--extents=2000] [--unrescued=0.05]" << std::endl
+            << "  [--frag=4] [--mismatch=0.0001] [--jpegs=400] [--files=20000] [--sector-size=2048] [--seed=1]" << std::endl
+            << " writes <out>.iso and <out>.log, a synthetic rescue of --size bytes in --extents rescued extents." << std::endl
+            << " --unrescued is the share of the disc between them, written as --frag mapfile lines per gap." << std::endl
+            << " -c writes OUT2.iso and OUT2.log, a second rescue in which --mismatch of the sectors differ." << std::endl
+            << " -x writes DIR.txt, an isodump listing of the --files files, --jpegs of them jpegs." << std::endl
+            << " --size takes a K, M or G suffix. The size must be more than 1M." << std::endl;
+        return 1;
+    }
+
+    try {
+        std::vector<FileSpan> files = makeFiles(opts);
+        writeImages(opts, files);
+        writeLog(opts.outName + ".log", makeLayout(opts, opts.seed));
+        if (!opts.cmpName.empty())
+            writeLog(opts.cmpName + ".log", makeLayout(opts, opts.seed + 1000003));
+        if (!opts.dirName.empty())
+            writeListing(opts, files);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}